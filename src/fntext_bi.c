@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -6,6 +7,16 @@
 #include <string.h>
 #include <assert.h>
 #include <omp.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "fntext_model.h"
+#if defined(__AVX512F__) || defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
 
 #define EM_RANGE (0.01)
 
@@ -25,17 +36,425 @@ struct dataset_t
     int64_t text_num;
 };
 
+// bf16: the upper 16 bits of a float
+// -bf16 keeps the per-sample activations and gradients in bf16, the weights stay in float
+// compile with -mavx512bf16 (or -march=native) to use the avx512-bf16 conversions
+typedef uint16_t bf16;
+
+static inline floatx bf16_to_float(bf16 x)
+{
+    union
+    {
+        uint32_t u;
+        float f;
+    } v;
+    v.u = (uint32_t)x << 16;
+    return v.f;
+}
+
+// round to nearest even, denormals are flushed to zero like vcvtneps2bf16
+static inline bf16 float_to_bf16(floatx f)
+{
+    union
+    {
+        uint32_t u;
+        float f;
+    } v;
+    v.f = f;
+    if ((v.u & 0x7f800000) == 0x7f800000)
+        return (bf16)((v.u >> 16) | ((v.u & 0x7fffff) ? 0x40 : 0)); // inf, quiet nan
+    if ((v.u & 0x7f800000) == 0)
+        return (bf16)((v.u >> 16) & 0x8000);
+    return (bf16)((v.u + 0x7fff + ((v.u >> 16) & 1)) >> 16);
+}
+
+void bf16_store(bf16 *dst, const floatx *src, int64_t n)
+{
+    int64_t i = 0;
+#ifdef __AVX512BF16__
+    for (; i + 16 <= n; i += 16)
+        _mm256_storeu_si256((__m256i *)&dst[i], (__m256i)_mm512_cvtneps_pbh(_mm512_loadu_ps(&src[i])));
+#endif
+    for (; i < n; i++)
+        dst[i] = float_to_bf16(src[i]);
+}
+
+void bf16_load(floatx *dst, const bf16 *src, int64_t n)
+{
+    int64_t i = 0;
+#ifdef __AVX512F__
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i x = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)&src[i]));
+        _mm512_storeu_ps(&dst[i], _mm512_castsi512_ps(_mm512_slli_epi32(x, 16)));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = bf16_to_float(src[i]);
+}
+
+// per-sample buffer of a batch, stored as floatx or bf16
+struct stage_t
+{
+    int64_t is_bf16;
+    floatx *f;
+    bf16 *h;
+};
+
+void init_stage(struct stage_t *s, int64_t n, int64_t is_bf16)
+{
+    s->is_bf16 = is_bf16;
+    s->f = is_bf16 ? NULL : (floatx *)malloc(n * sizeof(floatx));
+    s->h = is_bf16 ? (bf16 *)malloc(n * sizeof(bf16)) : NULL;
+}
+
+void free_stage(struct stage_t *s)
+{
+    free(s->f);
+    free(s->h);
+}
+
+// where to compute the values of [off, off + n): the buffer itself, or the float scratch in bf16 mode
+floatx *stage_ptr(struct stage_t *s, int64_t off, floatx *scratch)
+{
+    return s->is_bf16 ? scratch : &s->f[off];
+}
+
+// store the values computed at stage_ptr, in bf16 mode x is rounded in place
+void stage_commit(struct stage_t *s, int64_t off, floatx *x, int64_t n)
+{
+    if (s->is_bf16)
+    {
+        bf16_store(&s->h[off], x, n);
+        bf16_load(x, &s->h[off], n);
+    }
+}
+
+static inline floatx stage_get(const struct stage_t *s, int64_t i)
+{
+    return s->is_bf16 ? bf16_to_float(s->h[i]) : s->f[i];
+}
+
+// the values [off, off + n) as floats, in bf16 mode they are loaded into scratch
+static inline const floatx *stage_load(const struct stage_t *s, int64_t off, floatx *scratch, int64_t n)
+{
+    if (!s->is_bf16)
+        return &s->f[off];
+    bf16_load(scratch, &s->h[off], n);
+    return scratch;
+}
+
+// random numbers
+// counter-based: 第i个数只由(seed, stream, i)决定，和线程数、调用顺序无关，可以并行生成
+#define RNG_EM (1)
+#define RNG_EM_BI (2)
+#define RNG_W (3)
+#define RNG_W_BI (4)
+#define RNG_B (5)
+#define RNG_SHUFFLE (16) // + epoch
+
+static uint64_t rng_seed = 0;
+
+static inline uint64_t splitmix64(uint64_t z)
+{
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rng_u64(uint64_t stream, uint64_t i)
+{
+    return splitmix64(splitmix64(rng_seed ^ splitmix64(stream)) + i);
+}
+
+// [0, 1)
+static inline floatx rng_uniform(uint64_t stream, uint64_t i)
+{
+    return (floatx)(rng_u64(stream, i) >> 40) * (1.f / 16777216.f);
+}
+
+// shuffle index[0, n) with stream, the result only depends on the seed and stream
+// 1. 每个元素随机分到一个桶(约256个元素)，按原顺序稳定地放进桶里
+// 2. 每个桶内部做Fisher-Yates
+void shuffle_index(int64_t *index, int64_t n, uint64_t stream, int64_t threads_n)
+{
+    int64_t buckets_n = (n + 255) / 256;
+    int64_t *out = (int64_t *)malloc(n * sizeof(int64_t));
+    int64_t *counts = (int64_t *)calloc(threads_n * buckets_n + 1, sizeof(int64_t));
+    int64_t *bucket_start = (int64_t *)malloc((buckets_n + 1) * sizeof(int64_t));
+
+#pragma omp parallel num_threads(threads_n)
+    {
+        int64_t t = omp_get_thread_num(), nt = omp_get_num_threads();
+        int64_t i_start = n * t / nt, i_end = n * (t + 1) / nt;
+        int64_t *count = &counts[t * buckets_n];
+        for (int64_t i = i_start; i < i_end; i++)
+            count[rng_u64(stream, i) % buckets_n]++;
+#pragma omp barrier
+#pragma omp single
+        {
+            // 桶优先，同一个桶里线程按顺序，所以和线程数无关
+            int64_t off = 0;
+            for (int64_t b = 0; b < buckets_n; b++)
+            {
+                bucket_start[b] = off;
+                for (int64_t u = 0; u < nt; u++)
+                {
+                    int64_t c = counts[u * buckets_n + b];
+                    counts[u * buckets_n + b] = off;
+                    off += c;
+                }
+            }
+            bucket_start[buckets_n] = off;
+        }
+        for (int64_t i = i_start; i < i_end; i++)
+            out[count[rng_u64(stream, i) % buckets_n]++] = index[i];
+#pragma omp barrier
+#pragma omp for schedule(dynamic, 16)
+        for (int64_t b = 0; b < buckets_n; b++)
+        {
+            for (int64_t i = bucket_start[b]; i < bucket_start[b + 1] - 1; i++)
+            {
+                int64_t sel = i + rng_u64(stream, n + i) % (bucket_start[b + 1] - i);
+                int64_t tmp = out[i];
+                out[i] = out[sel];
+                out[sel] = tmp;
+            }
+        }
+    }
+    memcpy(index, out, n * sizeof(int64_t));
+    free(out);
+    free(counts);
+    free(bucket_start);
+}
+
+// numa
+// em/em_bi是随机gather的大表，放在哪个node上由 -numa 决定
+// first-touch: 谁先写谁的node(随机初始化按static分块并行写，页跟着各线程走；从文件加载时全在读文件线程的node上)
+// interleave: 按页轮流放在所有node上
+// partition: 按行分成连续的几段，第k段放在node k上
+#define PLACE_FIRST_TOUCH (0)
+#define PLACE_INTERLEAVE (1)
+#define PLACE_PARTITION (2)
+#define NUMA_MAX_NODES (64)
+
+static int64_t table_placement = PLACE_FIRST_TOUCH;
+
+// 训练线程绑核之后，后台线程(checkpoint写盘、评估)放在训练没用到的cpu上
+// 没有空闲的cpu时用所有绑过的cpu，helper_cpus_n == 0: 没有绑核，继承创建者的affinity
+static cpu_set_t helper_cpus;
+static int64_t helper_cpus_n = 0;
+
+// start a background thread on helper_cpus
+void start_helper_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (helper_cpus_n > 0 && pthread_attr_setaffinity_np(&attr, sizeof(helper_cpus), &helper_cpus) != 0)
+        printf("warning: can not set the affinity of a background thread\n");
+    if (pthread_create(thread, &attr, fn, arg) != 0)
+    {
+        printf("error: can not create a background thread");
+        exit(-1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+int64_t numa_nodes(void)
+{
+    char path[128];
+    int64_t n = 0;
+    while (n < NUMA_MAX_NODES)
+    {
+        sprintf(path, "/sys/devices/system/node/node%ld", n);
+        if (access(path, F_OK) != 0)
+            break;
+        n++;
+    }
+    return n > 0 ? n : 1;
+}
+
+// cpus of node, read from the "0-3,8-11" cpulist in sysfs, returns the count
+int64_t numa_node_cpus(int64_t node, int *cpus, int64_t max_n)
+{
+    char path[128];
+    int64_t n = 0;
+    int a, b;
+    sprintf(path, "/sys/devices/system/node/node%ld/cpulist", node);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        // 没有numa信息，当作一个node
+        for (a = 0; a < omp_get_num_procs() && n < max_n; a++)
+            cpus[n++] = a;
+        return n;
+    }
+    while (fscanf(fp, "%d", &a) == 1)
+    {
+        b = a;
+        int ch = fgetc(fp);
+        if (ch == '-')
+        {
+            if (fscanf(fp, "%d", &b) != 1)
+                break;
+            ch = fgetc(fp);
+        }
+        for (; a <= b && n < max_n; a++)
+            cpus[n++] = a;
+        if (ch != ',')
+            break;
+    }
+    fclose(fp);
+    return n;
+}
+
+// set the memory policy of [p, p + bytes) before it is touched, policy is MPOL_INTERLEAVE or MPOL_PREFERRED
+void numa_bind(void *p, int64_t bytes, int policy, uint64_t nodemask)
+{
+    if (syscall(SYS_mbind, p, (unsigned long)bytes, policy, &nodemask, (unsigned long)NUMA_MAX_NODES + 1, 0) != 0)
+        printf("warning: mbind failed, keep first-touch placement\n");
+}
+
+// parameter arena
+// 模型参数和优化器状态都从一块连续的映射里分配，checkpoint直接写这一块
+// 每张表记录行数和所属的组，em/em_bi组的表按行(词)增量拷贝，dense组每次整张拷贝
+#define ARENA_DENSE (0)
+#define ARENA_EM (1)
+#define ARENA_EM_BI (2)
+#define ARENA_MAX_TABLES (64)
+
+struct arena_table_t
+{
+    int64_t offset, bytes;
+    int64_t rows, group;
+};
+
+struct arena_t
+{
+    char *base;
+    int64_t size, used;
+    int64_t tables_n;
+    struct arena_table_t tables[ARENA_MAX_TABLES];
+};
+
+// 分配时如果有arena就从arena里分
+static struct arena_t *table_arena = NULL;
+
+// reserve size bytes, pages are only committed when touched
+void init_arena(struct arena_t *a, int64_t size)
+{
+    a->base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (a->base == MAP_FAILED)
+    {
+        printf("error: can not reserve an arena of %ld bytes", size);
+        exit(-1);
+    }
+    a->size = size;
+    a->used = 0;
+    a->tables_n = 0;
+}
+
+void free_arena(struct arena_t *a)
+{
+    munmap(a->base, a->size);
+}
+
+void *arena_alloc(struct arena_t *a, int64_t bytes)
+{
+    int64_t page = sysconf(_SC_PAGESIZE);
+    if (a->used + bytes > a->size || a->tables_n == ARENA_MAX_TABLES)
+    {
+        printf("error: arena is full (%ld + %ld > %ld bytes)", a->used, bytes, a->size);
+        exit(-1);
+    }
+    struct arena_table_t *table = &a->tables[a->tables_n++];
+    table->offset = a->used;
+    table->bytes = bytes;
+    table->rows = 1;
+    table->group = ARENA_DENSE;
+    a->used = (a->used + bytes + page - 1) / page * page;
+    return a->base + table->offset;
+}
+
+// mark the table at p as rows of group, no-op if p is not in the arena
+void arena_rows(struct arena_t *a, void *p, int64_t rows, int64_t group)
+{
+    if (a == NULL)
+        return;
+    for (int64_t k = 0; k < a->tables_n; k++)
+    {
+        if (a->base + a->tables[k].offset == (char *)p)
+        {
+            a->tables[k].rows = rows;
+            a->tables[k].group = group;
+        }
+    }
+}
+
+// page aligned, zero filled table placed by table_placement
+void *table_alloc(int64_t bytes)
+{
+    void *p = table_arena != NULL ? arena_alloc(table_arena, bytes) : mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        printf("error: can not allocate %ld bytes", bytes);
+        exit(-1);
+    }
+    int64_t nodes = numa_nodes();
+    if (nodes == 1 || table_placement == PLACE_FIRST_TOUCH)
+        return p;
+    if (table_placement == PLACE_INTERLEAVE)
+        numa_bind(p, bytes, MPOL_INTERLEAVE, nodes >= 64 ? ~0ull : (1ull << nodes) - 1);
+    else
+    {
+        int64_t page = sysconf(_SC_PAGESIZE);
+        for (int64_t k = 0; k < nodes; k++)
+        {
+            int64_t start = bytes * k / nodes / page * page, end = k == nodes - 1 ? bytes : bytes * (k + 1) / nodes / page * page;
+            if (end > start)
+                numa_bind((char *)p + start, end - start, MPOL_PREFERRED, 1ull << k);
+        }
+    }
+    return p;
+}
+
+// resident set size of the process, 0 if unknown
+int64_t rss_bytes(void)
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+void table_free(void *p, int64_t bytes)
+{
+    if (p == NULL)
+        return;
+    // arena里的表随arena一起释放
+    if (table_arena != NULL && (char *)p >= table_arena->base && (char *)p < table_arena->base + table_arena->size)
+        return;
+    munmap(p, bytes);
+}
+
 void init_model(struct model_t *model, int64_t em_dim, int64_t vocab_num, int64_t category_num, int64_t is_init)
 {
     model->em_dim = em_dim;
     model->vocab_num = vocab_num;
     model->category_num = category_num;
 
-    model->em = (floatx *)malloc(em_dim * vocab_num * sizeof(floatx));
-    model->em_bi = (floatx *)malloc(em_dim * vocab_num * sizeof(floatx));
-    model->w = (floatx *)malloc(em_dim * category_num * sizeof(floatx));
-    model->w_bi = (floatx *)malloc(em_dim * category_num * sizeof(floatx));
-    model->b = (floatx *)malloc(category_num * sizeof(floatx));
+    model->em = (floatx *)table_alloc(em_dim * vocab_num * sizeof(floatx));
+    model->em_bi = (floatx *)table_alloc(em_dim * vocab_num * sizeof(floatx));
+    model->w = (floatx *)table_alloc(em_dim * category_num * sizeof(floatx));
+    model->w_bi = (floatx *)table_alloc(em_dim * category_num * sizeof(floatx));
+    model->b = (floatx *)table_alloc(category_num * sizeof(floatx));
+    arena_rows(table_arena, model->em, vocab_num, ARENA_EM);
+    arena_rows(table_arena, model->em_bi, vocab_num, ARENA_EM_BI);
 
     floatx *em = model->em;
     floatx *em_bi = model->em_bi;
@@ -45,49 +464,97 @@ void init_model(struct model_t *model, int64_t em_dim, int64_t vocab_num, int64_
     int64_t i;
     if (is_init)
     {
-        srand(time(NULL));
         // [-EM_RANGE, EM_RANGE]
+#pragma omp parallel for schedule(static)
         for (i = 0; i < em_dim * vocab_num; i++)
         {
-            em[i] = ((floatx)rand() / RAND_MAX) * 2. * EM_RANGE - EM_RANGE;
-            em_bi[i] = ((floatx)rand() / RAND_MAX) * 2. * EM_RANGE - EM_RANGE;
+            em[i] = rng_uniform(RNG_EM, i) * 2. * EM_RANGE - EM_RANGE;
+            em_bi[i] = rng_uniform(RNG_EM_BI, i) * 2. * EM_RANGE - EM_RANGE;
         }
 
         floatx stdv = 1. / (floatx)sqrt((double)em_dim * 2);
         for (i = 0; i < em_dim * category_num; i++)
         {
-            w[i] = (floatx)rand() / RAND_MAX * 2. * stdv - stdv;
-            w_bi[i] = (floatx)rand() / RAND_MAX * 2. * stdv - stdv;
+            w[i] = rng_uniform(RNG_W, i) * 2. * stdv - stdv;
+            w_bi[i] = rng_uniform(RNG_W_BI, i) * 2. * stdv - stdv;
         }
 
         for (i = 0; i < category_num; i++)
-            b[i] = (floatx)rand() / RAND_MAX * 2. * stdv - stdv;
+            b[i] = rng_uniform(RNG_B, i) * 2. * stdv - stdv;
     }
-    else
-    {
-        for (i = 0; i < em_dim * vocab_num; i++)
-        {
-            em[i] = 0.;
-            em_bi[i] = 0.;
-        }
+    // 否则不写: 表都是新映射的零页，只有被访问到的页才占用物理内存
+}
+void free_model(struct model_t *model)
+{
+    table_free(model->em, model->em_dim * model->vocab_num * sizeof(floatx));
+    table_free(model->em_bi, model->em_dim * model->vocab_num * sizeof(floatx));
+    table_free(model->w, model->em_dim * model->category_num * sizeof(floatx));
+    table_free(model->w_bi, model->em_dim * model->category_num * sizeof(floatx));
+    table_free(model->b, model->category_num * sizeof(floatx));
+}
 
-        for (i = 0; i < em_dim * category_num; i++)
-        {
-            w[i] = 0.;
-            w_bi[i] = 0.;
-        }
+// model file, the format is in fntext_model.h
+// a model file mapped by map_model, the tables of the model point into it
+struct model_file_t
+{
+    char *base;
+    int64_t bytes;
+    struct model_header_t *header;
+    int32_t *vocab_map; // NULL: em row = token
+};
 
-        for (i = 0; i < category_num; i++)
-            b[i] = 0.;
+void save_model(struct model_t *model, const char *path, int64_t max_token)
+{
+    struct model_header_t header;
+    int64_t em_dim = model->em_dim, vocab_num = model->vocab_num, category_num = model->category_num;
+    const void *data[] = {model->em, model->em_bi, model->w, model->w_bi, model->b};
+
+    model_init_header(&header, VARIANT_BI, "bi", em_dim, vocab_num, category_num, max_token);
+    model_add_table(&header, "em", vocab_num, em_dim, MODEL_F32);
+    model_add_table(&header, "em_bi", vocab_num, em_dim, MODEL_F32);
+    model_add_table(&header, "w", category_num, em_dim, MODEL_F32);
+    model_add_table(&header, "w_bi", category_num, em_dim, MODEL_F32);
+    model_add_table(&header, "b", 1, category_num, MODEL_F32);
+    if (!model_file_write(path, &header, data))
+    {
+        printf("error: can not write model %s", path);
+        exit(-1);
     }
+    printf("saved model to %s (%.1f MB)\n", path, header.file_bytes / 1048576.);
 }
-void free_model(struct model_t *model)
+
+// map the model file at path with one mmap, model's tables point into the mapping
+void map_model(const char *path, struct model_t *model, struct model_file_t *mf)
+{
+    int64_t bad = 0;
+    if ((mf->base = model_file_map(path, &mf->bytes)) == NULL)
+        exit(-1);
+    struct model_header_t *header = mf->header = (struct model_header_t *)mf->base;
+    if (header->variant != VARIANT_BI)
+    {
+        printf("error: model %s is of variant %s, not bi", path, header->variant_name);
+        exit(-1);
+    }
+    int64_t em_dim = header->em_dim, vocab_num = header->vocab_num, category_num = header->category_num;
+    model->em_dim = em_dim;
+    model->vocab_num = vocab_num;
+    model->category_num = category_num;
+    model->em = (floatx *)model_file_table(mf->base, mf->bytes, "em", vocab_num, em_dim, MODEL_F32, &bad);
+    model->em_bi = (floatx *)model_file_table(mf->base, mf->bytes, "em_bi", vocab_num, em_dim, MODEL_F32, &bad);
+    model->w = (floatx *)model_file_table(mf->base, mf->bytes, "w", category_num, em_dim, MODEL_F32, &bad);
+    model->w_bi = (floatx *)model_file_table(mf->base, mf->bytes, "w_bi", category_num, em_dim, MODEL_F32, &bad);
+    model->b = (floatx *)model_file_table(mf->base, mf->bytes, "b", 1, category_num, MODEL_F32, &bad);
+    mf->vocab_map = (int32_t *)model_file_table(mf->base, mf->bytes, "vocab_map", header->max_token, 1, MODEL_I32, &bad);
+    if (bad || model->em == NULL || model->em_bi == NULL || model->w == NULL || model->w_bi == NULL || model->b == NULL)
+    {
+        printf("error: model %s misses a table", path);
+        exit(-1);
+    }
+}
+
+void unmap_model(struct model_file_t *mf)
 {
-    free(model->em);
-    free(model->em_bi);
-    free(model->w);
-    free(model->w_bi);
-    free(model->b);
+    munmap(mf->base, mf->bytes);
 }
 
 int preread(FILE *fp)
@@ -243,26 +710,27 @@ void free_data(struct dataset_t *data)
     free(data->start_pos);
 }
 
-floatx forward(struct model_t *model, struct dataset_t *train_data, int64_t text_i, floatx *max_fea, int64_t *max_fea_index, floatx *max_bi_fea, int64_t *max_bi_fea_index, floatx *softmax_fea)
+// max_pool of the tokens [start, end) and of the bigrams starting in [start, end)
+// 最后一个bigram会读到end位置的token，所以分段pooling再合并和整段pooling的结果一样
+// 下标是em里的绝对位置，和token在文中的位置无关，合并时不需要偏移
+void pool_range(struct model_t *model, int64_t *text_indices, int64_t text_len, int64_t start, int64_t end,
+                floatx *max_fea, int64_t *max_fea_index, floatx *max_bi_fea, int64_t *max_bi_fea_index)
 {
-    int64_t *text_indices = &(train_data->text_indices[train_data->start_pos[text_i]]);
-    int64_t text_len = train_data->text_lens[text_i];
-    assert(text_len >= 1);
-    int64_t text_category = train_data->text_categories[text_i];
-
     int64_t i, j;
     int64_t em_pos, em_pos0, em_pos1;
+    int64_t pair_end = (text_len > 1) ? text_len - 1 : 1; // 长度为1 那么就把那个单词复制一个
+    pair_end = end < pair_end ? end : pair_end;
 
     // max_pool
     // 先赋预值
-    em_pos = text_indices[0] * model->em_dim;
+    em_pos = text_indices[start] * model->em_dim;
     for (i = 0; i < model->em_dim; i++)
     {
         max_fea[i] = model->em[em_pos + i];
         max_fea_index[i] = em_pos + i;
     }
 
-    for (i = 1; i < text_len; i++)
+    for (i = start + 1; i < end; i++)
     {
         em_pos = text_indices[i] * model->em_dim;
         for (j = 0; j < model->em_dim; j++)
@@ -273,22 +741,28 @@ floatx forward(struct model_t *model, struct dataset_t *train_data, int64_t text
     }
 
     // max_pool bi
-    // 先赋预值
-    em_pos0 = text_indices[0] * model->em_dim;
-    em_pos1 = (text_len > 1) ? (text_indices[1] * model->em_dim) : (text_indices[0] * model->em_dim); //长度为1 那么就把那个单词复制一个
-    for (j = 0; j < model->em_dim; j++)
+    // 这一段没有bigram(只有文本的最后一个token)，合并时不会被选中
+    if (start >= pair_end)
     {
-        max_bi_fea[j] = (model->em_bi[em_pos0 + j] + model->em_bi[em_pos1 + j]) * 0.5;  // take average
-        max_bi_fea_index[0] = em_pos0 + j;
-        max_bi_fea_index[1] = em_pos1 + j;
+        for (j = 0; j < model->em_dim; j++)
+        {
+            max_bi_fea[j] = -INFINITY;
+            max_bi_fea_index[2 * j] = max_bi_fea_index[2 * j + 1] = 0;
+        }
+        return;
     }
 
-    if (text_len == 1)
+    // 先赋预值
+    em_pos0 = text_indices[start] * model->em_dim;
+    em_pos1 = (text_len > 1) ? (text_indices[start + 1] * model->em_dim) : (text_indices[start] * model->em_dim);
+    for (j = 0; j < model->em_dim; j++)
     {
-        // printf("warning: text[id: %ld] length == 1 (bi-gram features need length>1)\n", text_i);
+        max_bi_fea[j] = (model->em_bi[em_pos0 + j] + model->em_bi[em_pos1 + j]) * 0.5;  // take average
+        max_bi_fea_index[2 * j] = em_pos0 + j;
+        max_bi_fea_index[2 * j + 1] = em_pos1 + j;
     }
 
-    for (i = 1; i < text_len - 1; i++)
+    for (i = start + 1; i < pair_end; i++)
     {
         em_pos0 = text_indices[i] * model->em_dim;
         em_pos1 = text_indices[i + 1] * model->em_dim;
@@ -304,14 +778,107 @@ floatx forward(struct model_t *model, struct dataset_t *train_data, int64_t text
             }
         }
     }
+}
+
+// pool_range for prediction: the same maxima, without tracking the argmax indices
+void pool_range_max(struct model_t *model, int64_t *text_indices, int64_t text_len, int64_t start, int64_t end, floatx *max_fea, floatx *max_bi_fea)
+{
+    int64_t em_dim = model->em_dim;
+    int64_t pair_end = (text_len > 1) ? text_len - 1 : 1;
+    pair_end = end < pair_end ? end : pair_end;
+
+    memcpy(max_fea, &model->em[text_indices[start] * em_dim], em_dim * sizeof(floatx));
+    for (int64_t i = start + 1; i < end; i++)
+    {
+        const floatx *e = &model->em[text_indices[i] * em_dim];
+        for (int64_t j = 0; j < em_dim; j++)
+            max_fea[j] = max_fea[j] > e[j] ? max_fea[j] : e[j];
+    }
+
+    if (start >= pair_end)
+    {
+        for (int64_t j = 0; j < em_dim; j++)
+            max_bi_fea[j] = -INFINITY;
+        return;
+    }
+    const floatx *e0 = &model->em_bi[text_indices[start] * em_dim];
+    const floatx *e1 = (text_len > 1) ? &model->em_bi[text_indices[start + 1] * em_dim] : e0;
+    for (int64_t j = 0; j < em_dim; j++)
+        max_bi_fea[j] = (e0[j] + e1[j]) * 0.5;
+    for (int64_t i = start + 1; i < pair_end; i++)
+    {
+        e0 = &model->em_bi[text_indices[i] * em_dim];
+        e1 = &model->em_bi[text_indices[i + 1] * em_dim];
+        for (int64_t j = 0; j < em_dim; j++)
+        {
+            floatx fea = (e0[j] + e1[j]) * 0.5;
+            max_bi_fea[j] = max_bi_fea[j] < fea ? fea : max_bi_fea[j];
+        }
+    }
+}
+
+// merge the pooling of the following range into max_fea/max_bi_fea
+// 和pool_range里的比较方式一致: unigram相等时取后面的，bigram相等时取前面的
+// 索引为NULL时只合并最大值(预测)
+void pool_merge(int64_t em_dim, floatx *max_fea, int64_t *max_fea_index, floatx *max_bi_fea, int64_t *max_bi_fea_index,
+                const floatx *fea, const int64_t *fea_index, const floatx *bi_fea, const int64_t *bi_fea_index)
+{
+    if (max_fea_index == NULL)
+    {
+        for (int64_t j = 0; j < em_dim; j++)
+        {
+            max_fea[j] = fea[j] >= max_fea[j] ? fea[j] : max_fea[j];
+            max_bi_fea[j] = max_bi_fea[j] < bi_fea[j] ? bi_fea[j] : max_bi_fea[j];
+        }
+        return;
+    }
+    for (int64_t j = 0; j < em_dim; j++)
+    {
+        if (fea[j] >= max_fea[j])
+        {
+            max_fea[j] = fea[j];
+            max_fea_index[j] = fea_index[j];
+        }
+        if (max_bi_fea[j] < bi_fea[j])
+        {
+            max_bi_fea[j] = bi_fea[j];
+            max_bi_fea_index[2 * j] = bi_fea_index[2 * j];
+            max_bi_fea_index[2 * j + 1] = bi_fea_index[2 * j + 1];
+        }
+    }
+}
+
+// mlp on the pooled features
+void head_logits(struct model_t *model, floatx *max_fea, floatx *max_bi_fea, floatx *logits)
+{
+    int64_t i, j;
 
-    // mlp
     for (i = 0; i < model->category_num; i++)
-        softmax_fea[i] = model->b[i];
+        logits[i] = model->b[i];
 
     for (i = 0; i < model->category_num; i++)
         for (j = 0; j < model->em_dim; j++)
-            softmax_fea[i] += (max_fea[j] * model->w[i * model->em_dim + j] + max_bi_fea[j] * model->w_bi[i * model->em_dim + j]);
+            logits[i] += (max_fea[j] * model->w[i * model->em_dim + j] + max_bi_fea[j] * model->w_bi[i * model->em_dim + j]);
+}
+
+// argmax of the logits, exp is monotonic so it is the argmax of the softmax
+int64_t predict_head(struct model_t *model, floatx *max_fea, floatx *max_bi_fea, floatx *logits)
+{
+    int64_t label = 0;
+    head_logits(model, max_fea, max_bi_fea, logits);
+    for (int64_t c = 1; c < model->category_num; c++)
+        if (logits[c] > logits[label])
+            label = c;
+    return label;
+}
+
+// mlp and softmax on the pooled features, returns the loss
+floatx forward_head(struct model_t *model, int64_t text_category, floatx *max_fea, floatx *max_bi_fea, floatx *softmax_fea)
+{
+    int64_t i;
+
+    // mlp
+    head_logits(model, max_fea, max_bi_fea, softmax_fea);
 
     floatx loss = 0.;
     floatx tmp = 0.;
@@ -325,7 +892,24 @@ floatx forward(struct model_t *model, struct dataset_t *train_data, int64_t text
     return loss;
 }
 
-void backward(struct model_t *model, struct dataset_t *train_data, int64_t text_i, floatx *max_fea, floatx *max_fea_bi, floatx *softmax_fea, floatx *grad_em, float *grad_em_bi, floatx *grad_w, float *grad_w_bi, floatx *grad_b)
+floatx forward(struct model_t *model, struct dataset_t *train_data, int64_t text_i, floatx *max_fea, int64_t *max_fea_index, floatx *max_bi_fea, int64_t *max_bi_fea_index, floatx *softmax_fea)
+{
+    int64_t *text_indices = &(train_data->text_indices[train_data->start_pos[text_i]]);
+    int64_t text_len = train_data->text_lens[text_i];
+    assert(text_len >= 1);
+    int64_t text_category = train_data->text_categories[text_i];
+
+    if (text_len == 1)
+    {
+        // printf("warning: text[id: %ld] length == 1 (bi-gram features need length>1)\n", text_i);
+    }
+
+    pool_range(model, text_indices, text_len, 0, text_len, max_fea, max_fea_index, max_bi_fea, max_bi_fea_index);
+    return forward_head(model, text_category, max_fea, max_bi_fea, softmax_fea);
+}
+
+// grad_b也是w, w_bi这个样本的梯度的系数，w, w_bi, b的梯度在整个batch算完后再合并
+void backward(struct model_t *model, struct dataset_t *train_data, int64_t text_i, floatx *softmax_fea, floatx *grad_em, float *grad_em_bi, floatx *grad_b, floatx loss_scale)
 {
     int64_t *text_indices = &(train_data->text_indices[train_data->start_pos[text_i]]);
     int64_t text_len = train_data->text_lens[text_i];
@@ -338,15 +922,9 @@ void backward(struct model_t *model, struct dataset_t *train_data, int64_t text_
     for (i = 0; i < model->category_num; i++)
         grad_b[i] = softmax_fea[i] / tmp_sum;
     grad_b[text_category] -= 1.;
-
-    for (i = 0; i < model->category_num; i++)
-        for (j = 0; j < model->em_dim; j++)
-            grad_w[i * model->em_dim + j] = max_fea[j] * grad_b[i];
-
-    // bi
-    for (i = 0; i < model->category_num; i++)
-        for (j = 0; j < model->em_dim; j++)
-            grad_w_bi[i * model->em_dim + j] = max_fea_bi[j] * grad_b[i];
+    if (loss_scale != 1.)
+        for (i = 0; i < model->category_num; i++)
+            grad_b[i] *= loss_scale;
 
     for (j = 0; j < model->em_dim; j++)
         grad_em[j] = 0.;
@@ -362,350 +940,2350 @@ void backward(struct model_t *model, struct dataset_t *train_data, int64_t text_
             grad_em_bi[j] += (model->w_bi[i * model->em_dim + j]) * grad_b[i];
 }
 
-void evaluate(struct model_t *model, struct dataset_t *vali_data, int64_t batch_size, int64_t threads_n)
-{
-    printf("evaluating...\n");
+// work stealing
+// 一个batch的样本按token数切成任务，相邻的短文本合成一个任务，长文本切成几段分别pooling
+// 任务按权重连续地分给各个线程，线程从自己队列的头部取任务，空了就从别的线程队列的尾部偷
+// 任务在batch开始前全部生成，之后不会再增加，所以偷一圈都是空的就可以结束
+#define SPLIT_TOKENS (4096) // default of -split-len
+#define TASK_GRAIN (8) // 平均每个线程分到的任务数
 
-    time_t eva_start, eva_end;
-    eva_start = time(NULL);
+struct pool_task_t
+{
+    int64_t j_start, j_end;     // samples [j_start, j_end) of the batch
+    int64_t tok_start, tok_end; // long text: the token range of this part
+    int64_t part, part0, parts; // long text: part id, first part id and number of parts of the text, parts == 0 otherwise
+    int64_t weight;
+};
+
+// [head, tail) in one word, the owner and the thieves both move it with cas
+struct task_deque_t
+{
+    uint64_t range;
+    char pad[56];
+};
+
+struct task_queue_t
+{
+    int64_t em_dim;
+    struct pool_task_t *tasks;
+    int64_t tasks_n, tasks_cap;
+    struct task_deque_t *deques;
+    int64_t *parts_left; // per sample: parts not pooled yet
+    floatx *part_feas;   // per part: [max_fea | max_bi_fea]
+    int64_t *part_indexs; // per part: [max_fea_index | max_bi_fea_index]
+    int64_t parts_n, parts_cap;
+};
+
+void init_task_queue(struct task_queue_t *q, int64_t samples_n, int64_t em_dim, int64_t threads_n)
+{
+    q->em_dim = em_dim;
+    q->tasks_cap = samples_n;
+    q->tasks = (struct pool_task_t *)malloc(q->tasks_cap * sizeof(struct pool_task_t));
+    q->tasks_n = 0;
+    q->deques = (struct task_deque_t *)aligned_alloc(64, threads_n * sizeof(struct task_deque_t));
+    memset(q->deques, 0, threads_n * sizeof(struct task_deque_t));
+    q->parts_left = (int64_t *)calloc(samples_n, sizeof(int64_t));
+    q->parts_cap = 0;
+    q->parts_n = 0;
+    q->part_feas = NULL;
+    q->part_indexs = NULL;
+}
+
+void free_task_queue(struct task_queue_t *q)
+{
+    free(q->tasks);
+    free(q->deques);
+    free(q->parts_left);
+    free(q->part_feas);
+    free(q->part_indexs);
+}
+
+// cut samples text_ids[0, n) into tasks and deal them to nt deques, called by one thread
+// extra_weight: cost of the mlp of one sample in tokens
+void build_pool_tasks(struct task_queue_t *q, struct dataset_t *data, int64_t *text_ids, int64_t n, int64_t extra_weight, int64_t split_len, int64_t nt)
+{
+    int64_t j, tasks_n = n, parts_n = 0, total = 0;
+
+    for (j = 0; j < n; j++)
+    {
+        int64_t text_len = data->text_lens[text_ids[j]];
+        total += text_len + extra_weight;
+        if (text_len > split_len)
+        {
+            parts_n += (text_len + split_len - 1) / split_len;
+            tasks_n += (text_len + split_len - 1) / split_len;
+        }
+    }
+    if (tasks_n > q->tasks_cap)
+    {
+        q->tasks_cap = tasks_n;
+        q->tasks = (struct pool_task_t *)realloc(q->tasks, q->tasks_cap * sizeof(struct pool_task_t));
+    }
+    if (parts_n > q->parts_cap)
+    {
+        q->parts_cap = parts_n;
+        q->part_feas = (floatx *)realloc(q->part_feas, q->parts_cap * 2 * q->em_dim * sizeof(floatx));
+        q->part_indexs = (int64_t *)realloc(q->part_indexs, q->parts_cap * 3 * q->em_dim * sizeof(int64_t));
+    }
+
+    int64_t grain = total / (nt * TASK_GRAIN) + 1;
+    q->tasks_n = 0;
+    q->parts_n = 0;
+    for (j = 0; j < n;)
+    {
+        int64_t text_len = data->text_lens[text_ids[j]];
+        if (text_len > split_len)
+        {
+            int64_t parts = (text_len + split_len - 1) / split_len;
+            q->parts_left[j] = parts;
+            for (int64_t p = 0; p < parts; p++)
+            {
+                struct pool_task_t *task = &q->tasks[q->tasks_n++];
+                task->j_start = j;
+                task->j_end = j + 1;
+                task->tok_start = text_len * p / parts;
+                task->tok_end = text_len * (p + 1) / parts;
+                task->part = q->parts_n + p;
+                task->part0 = q->parts_n;
+                task->parts = parts;
+                task->weight = task->tok_end - task->tok_start + (p == parts - 1 ? extra_weight : 0);
+            }
+            q->parts_n += parts;
+            j++;
+            continue;
+        }
+        struct pool_task_t *task = &q->tasks[q->tasks_n++];
+        task->j_start = j;
+        task->weight = 0;
+        task->parts = 0;
+        while (j < n && data->text_lens[text_ids[j]] <= split_len && task->weight < grain)
+        {
+            task->weight += data->text_lens[text_ids[j]] + extra_weight;
+            j++;
+        }
+        task->j_end = j;
+    }
+
+    // 按累计权重的中点决定任务属于哪个线程，每个线程分到连续的一段
+    int64_t cum = 0, u = 0, first = 0;
+    for (int64_t k = 0; k < q->tasks_n; k++)
+    {
+        int64_t owner = (cum + q->tasks[k].weight / 2) * nt / (total > 0 ? total : 1);
+        owner = owner < nt - 1 ? owner : nt - 1;
+        for (; u < owner; u++)
+        {
+            q->deques[u].range = ((uint64_t)k << 32) | (uint64_t)first;
+            first = k;
+        }
+        cum += q->tasks[k].weight;
+    }
+    for (; u < nt; u++)
+    {
+        q->deques[u].range = ((uint64_t)q->tasks_n << 32) | (uint64_t)first;
+        first = q->tasks_n;
+    }
+}
+
+// take a task from the head of deque t, or steal one from the tail of another deque, -1 if all are empty
+int64_t next_pool_task(struct task_queue_t *q, int64_t t, int64_t nt)
+{
+    for (int64_t v = 0; v < nt; v++)
+    {
+        uint64_t *range = &q->deques[(t + v) % nt].range;
+        uint64_t r = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+        for (;;)
+        {
+            uint64_t head = r & 0xffffffffu, tail = r >> 32;
+            if (head >= tail)
+                break;
+            uint64_t next = v == 0 ? ((tail << 32) | (head + 1)) : (((tail - 1) << 32) | head);
+            if (__atomic_compare_exchange_n(range, &r, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return v == 0 ? (int64_t)head : (int64_t)(tail - 1);
+        }
+    }
+    return -1;
+}
+
+// merge the pooled parts of the long text of task into max_fea/max_bi_fea
+// 按顺序合并各段，结果和整段pooling一样
+void pool_parts(struct task_queue_t *q, struct pool_task_t *task, floatx *max_fea, int64_t *max_fea_index, floatx *max_bi_fea, int64_t *max_bi_fea_index)
+{
+    int64_t em_dim = q->em_dim;
+    for (int64_t p = task->part0; p < task->part0 + task->parts; p++)
+    {
+        floatx *fea = &q->part_feas[2 * p * em_dim];
+        int64_t *index = &q->part_indexs[3 * p * em_dim];
+        if (p == task->part0)
+        {
+            memcpy(max_fea, fea, em_dim * sizeof(floatx));
+            memcpy(max_bi_fea, fea + em_dim, em_dim * sizeof(floatx));
+            if (max_fea_index != NULL)
+            {
+                memcpy(max_fea_index, index, em_dim * sizeof(int64_t));
+                memcpy(max_bi_fea_index, index + em_dim, 2 * em_dim * sizeof(int64_t));
+            }
+        }
+        else
+            pool_merge(em_dim, max_fea, max_fea_index, max_bi_fea, max_bi_fea_index, fea, index, fea + em_dim, index + em_dim);
+    }
+}
+
+// pool one part of the long text text_i, returns 1 if it was the last part left of the text
+// with_index = 0: 只求最大值(预测)，之后用pool_parts(.., NULL, .., NULL)合并
+int64_t pool_part(struct task_queue_t *q, struct pool_task_t *task, struct model_t *model, struct dataset_t *data, int64_t text_i, int64_t with_index)
+{
+    int64_t em_dim = q->em_dim;
+    floatx *fea = &q->part_feas[2 * task->part * em_dim];
+    int64_t *index = &q->part_indexs[3 * task->part * em_dim];
+    if (with_index)
+        pool_range(model, &data->text_indices[data->start_pos[text_i]], data->text_lens[text_i], task->tok_start, task->tok_end,
+                   fea, index, fea + em_dim, index + em_dim);
+    else
+        pool_range_max(model, &data->text_indices[data->start_pos[text_i]], data->text_lens[text_i], task->tok_start, task->tok_end,
+                       fea, fea + em_dim);
+    return __atomic_sub_fetch(&q->parts_left[task->j_start], 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// argmax of text text_i
+// 只要预测的类别: 不求索引，不算exp和loss
+void evaluate_sample(struct model_t *model, struct dataset_t *vali_data, struct task_queue_t *q, struct pool_task_t *task, int64_t text_i,
+                     floatx *max_fea, floatx *max_bi_fea, floatx *logits, int64_t *pre_label)
+{
+    // 长度为0的text，不计算梯度
+    // 会导致问题，比如梯度没有更新
+    // 应该在生成数据时避免
+    if (vali_data->text_lens[text_i] == 0)
+    {
+        printf("error: vali text length can not be zero.[text id: %ld]", text_i);
+        exit(-1);
+    }
+
+    if (task->parts == 0)
+        pool_range_max(model, &vali_data->text_indices[vali_data->start_pos[text_i]], vali_data->text_lens[text_i], 0, vali_data->text_lens[text_i],
+                       max_fea, max_bi_fea);
+    else
+        pool_parts(q, task, max_fea, NULL, max_bi_fea, NULL);
+    *pre_label = predict_head(model, max_fea, max_bi_fea, logits);
+}
+
+// buffers of evaluate_counts, allocated once and reused by every evaluation
+// batch_size: texts per round of pooling tasks, independent of the training batch size
+struct eval_buffers_t
+{
+    int64_t batch_size, threads_n;
+    int64_t *text_ids;
+    struct task_queue_t queue;
+    // float scratch of one sample per thread: [max_fea | max_bi_fea | logits]
+    int64_t scratch_n;
+    floatx *scratches;
+    // 每个线程一份计数分片 [cat_all | cat_true]，按64字节对齐，评估结束时合并
+    int64_t shard_n;
+    int64_t *shards;
+};
+
+void init_eval_buffers(struct eval_buffers_t *eb, int64_t em_dim, int64_t category_num, int64_t batch_size, int64_t threads_n)
+{
+    eb->batch_size = batch_size;
+    eb->threads_n = threads_n;
+    eb->text_ids = (int64_t *)malloc(batch_size * sizeof(int64_t));
+    init_task_queue(&eb->queue, batch_size, em_dim, threads_n);
+    eb->scratch_n = 2 * em_dim + category_num;
+    eb->scratches = (floatx *)malloc(threads_n * eb->scratch_n * sizeof(floatx));
+    eb->shard_n = (2 * category_num + 7) / 8 * 8;
+    eb->shards = (int64_t *)aligned_alloc(64, threads_n * eb->shard_n * sizeof(int64_t));
+}
+
+void free_eval_buffers(struct eval_buffers_t *eb)
+{
+    free(eb->text_ids);
+    free_task_queue(&eb->queue);
+    free(eb->scratches);
+    free(eb->shards);
+}
+
+// count the samples (cat_all) and the correct predictions (cat_true) of each category
+// 每个线程只写自己的分片，batch之间没有串行的统计
+void evaluate_counts(struct model_t *model, struct dataset_t *vali_data, struct eval_buffers_t *eb, int64_t split_len, floatx *cat_all, floatx *cat_true)
+{
+    int64_t batch_size = eb->batch_size, category_num = model->category_num, em_dim = model->em_dim;
+    struct task_queue_t *queue = &eb->queue;
+    memset(eb->shards, 0, eb->threads_n * eb->shard_n * sizeof(int64_t));
+
+#pragma omp parallel num_threads(eb->threads_n)
+    {
+        int64_t t = omp_get_thread_num(), nt = omp_get_num_threads();
+        int64_t *shard = &eb->shards[t * eb->shard_n];
+        floatx *max_fea = &eb->scratches[t * eb->scratch_n], *max_bi_fea = max_fea + em_dim, *logits = max_bi_fea + em_dim;
+        for (int64_t batch_i = 0; batch_i < (vali_data->text_num + batch_size - 1) / batch_size; batch_i++)
+        {
+            int64_t real_batch_size = (vali_data->text_num - batch_i * batch_size) > batch_size ? batch_size : (vali_data->text_num - batch_i * batch_size);
+#pragma omp single
+            {
+                for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
+                    eb->text_ids[batch_j] = batch_i * batch_size + batch_j;
+                build_pool_tasks(queue, vali_data, eb->text_ids, real_batch_size, 2 * category_num, split_len, nt);
+            }
+
+            int64_t task_i;
+            while ((task_i = next_pool_task(queue, t, nt)) >= 0)
+            {
+                struct pool_task_t *task = &queue->tasks[task_i];
+                if (task->parts > 0 && !pool_part(queue, task, model, vali_data, batch_i * batch_size + task->j_start, 0))
+                    continue;
+                for (int64_t batch_j = task->j_start; batch_j < task->j_end; batch_j++)
+                {
+                    int64_t text_i = (batch_i)*batch_size + batch_j, pre_label;
+                    assert(text_i < vali_data->text_num);
+                    int64_t real_label = vali_data->text_categories[text_i];
+                    evaluate_sample(model, vali_data, queue, task, text_i, max_fea, max_bi_fea, logits, &pre_label);
+                    shard[real_label] += 1;
+                    shard[category_num + real_label] += real_label == pre_label;
+                }
+            }
+            // 下一个batch重建任务前，所有线程都要做完这个batch
+#pragma omp barrier
+        }
+    }
+
+    for (int64_t k = 0; k < category_num; k++)
+    {
+        cat_all[k] = 0.;
+        cat_true[k] = 0.;
+        for (int64_t t = 0; t < eb->threads_n; t++)
+        {
+            cat_all[k] += eb->shards[t * eb->shard_n + k];
+            cat_true[k] += eb->shards[t * eb->shard_n + category_num + k];
+        }
+    }
+}
+
+// -eval-log: append the precisions of every evaluation to this file
+static const char *eval_log_path = NULL;
+
+// print the precisions, tag says which model was evaluated
+// the lines of one report are printed together, training may be printing from another thread
+void report_eval(const char *tag, int64_t category_num, floatx *cat_all, floatx *cat_true, double seconds)
+{
+    floatx cat_all_sum = 0.;
+    floatx cat_true_sum = 0.;
+    for (int64_t k = 0; k < category_num; k++)
+    {
+        cat_all_sum += cat_all[k];
+        cat_true_sum += cat_true[k];
+    }
+
+    flockfile(stdout);
+    printf("%s:\n", tag);
+    printf("#samples: %.0f\n", cat_all_sum);
+    FILE *fp = eval_log_path != NULL ? fopen(eval_log_path, "a") : NULL;
+    printf("macro precision: %.5f\n", cat_true_sum / cat_all_sum);
+    if (fp != NULL)
+        fprintf(fp, "%s:\nmacro precision: %.5f\n", tag, cat_true_sum / cat_all_sum);
+    for (int64_t k = 0; k < category_num; k++)
+    {
+        printf("   category #%ld precision: %.5f\n", k, cat_true[k] / cat_all[k]);
+        if (fp != NULL)
+            fprintf(fp, "   category #%ld precision: %.5f\n", k, cat_true[k] / cat_all[k]);
+    }
+    if (fp != NULL)
+        fclose(fp);
+    printf("   evaluating time: %.2fs\n", seconds);
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+void evaluate(struct model_t *model, struct dataset_t *vali_data, struct eval_buffers_t *eb, int64_t split_len, const char *tag)
+{
+    printf("evaluating...\n");
+    double start = omp_get_wtime();
+    floatx cat_all[model->category_num], cat_true[model->category_num];
+    evaluate_counts(model, vali_data, eb, split_len, cat_all, cat_true);
+    report_eval(tag, model->category_num, cat_all, cat_true, omp_get_wtime() - start);
+}
+
+// optimizers
+// 所有参数都按行更新: em/em_bi 每行是一个词, w/w_bi 每行是一个类别, b 只有一行
+// em/em_bi 的梯度是稀疏的, 只更新 grad != 0 的元素; w/w_bi/b 是稠密的, adam 类的 m/v 每步都衰减
+// sgd/adagrad/ftrl 在 grad == 0 时本来就不改变参数, 两种表的行为相同
+#define Q8_BLOCK (64)
+
+// state of one parameter table, the meaning of the arrays depends on the optimizer
+struct opt_state_t
+{
+    int64_t rows, dim, row_blocks;
+    floatx *m, *v;             // adam: rows * dim each; rowwise: m rows * dim, v rows; adagrad: v rows; ftrl: z, n
+    int8_t *qm;                // q8: m / m_scale * 127
+    uint8_t *qv;               // q8: sqrt(v) / v_scale * 255
+    floatx *m_scale, *v_scale; // q8: rows * row_blocks
+    int64_t m_n, v_n;          // number of elements of m, v
+    int64_t sparse;            // skip the elements whose grad is 0
+};
+
+struct optimizer_t;
+
+struct opt_ops_t
+{
+    const char *name;
+    floatx default_lr;
+    int64_t (*state_bytes)(int64_t rows, int64_t dim);
+    void (*init_state)(struct opt_state_t *s);
+    // apply the accumulated gradient of one row and clear it
+    void (*update_row)(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row);
+};
+
+struct optimizer_t
+{
+    const struct opt_ops_t *ops;
+    floatx lr, lr_t;                                 // lr_t: lr of the current step, sgd decays it linearly
+    floatx beta1, beta2, beta1t, beta2t, epsilon;    // adam
+    floatx ftrl_beta, l1, l2;                        // ftrl
+};
 
-    floatx *max_feas = (floatx *)malloc(model->em_dim * batch_size * sizeof(floatx));
-    int64_t *max_fea_indexs = (int64_t *)malloc(model->em_dim * batch_size * sizeof(int64_t));
-    floatx *max_bi_feas = (floatx *)malloc(model->em_dim * batch_size * sizeof(floatx));
-    int64_t *max_bi_fea_indexs = (int64_t *)malloc(2 * model->em_dim * batch_size * sizeof(int64_t));
-    floatx *softmax_feas = (floatx *)malloc(model->category_num * batch_size * sizeof(floatx));
+int64_t adam_state_bytes(int64_t rows, int64_t dim)
+{
+    return 2 * rows * dim * sizeof(floatx);
+}
 
-    int64_t *pre_labels = (int64_t *)malloc(batch_size * sizeof(int64_t));
-    int64_t *real_labels = (int64_t *)malloc(batch_size * sizeof(int64_t));
-    // 临界资源
-    floatx *cat_all = (floatx *)malloc(model->category_num * sizeof(floatx));
-    floatx *cat_true = (floatx *)malloc(model->category_num * sizeof(floatx));
+void adam_init_state(struct opt_state_t *s)
+{
+    s->m_n = s->v_n = s->rows * s->dim;
+    s->m = (floatx *)table_alloc(s->m_n * sizeof(floatx));
+    s->v = (floatx *)table_alloc(s->v_n * sizeof(floatx));
+}
 
-    for (int64_t i = 0; i < model->category_num; i++)
+void adam_update_row(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row)
+{
+    int64_t start = row * s->dim;
+    floatx *m = s->m + start, *v = s->v + start;
+    floatx beta1 = opt->beta1, beta2 = opt->beta2;
+    param += start;
+    grad += start;
+    for (int64_t j = 0; j < s->dim; j++)
     {
-        cat_all[i] = 0.;
-        cat_true[i] = 0.;
+        floatx g = grad[j];
+        if (g == 0. && s->sparse)
+            continue;
+        m[j] = beta1 * m[j] + (1 - beta1) * g;
+        v[j] = beta2 * v[j] + (1 - beta2) * g * g;
+        grad[j] = 0.;
+
+        floatx m_hat = m[j] / (1 - opt->beta1t);
+        floatx v_hat = v[j] / (1 - opt->beta2t);
+        param[j] -= opt->lr_t * m_hat / ((floatx)sqrt((floatx)v_hat) + opt->epsilon);
+    }
+}
+
+int64_t rowwise_state_bytes(int64_t rows, int64_t dim)
+{
+    return rows * dim * sizeof(floatx) + rows * sizeof(floatx);
+}
+
+void rowwise_init_state(struct opt_state_t *s)
+{
+    s->m_n = s->rows * s->dim;
+    s->v_n = s->rows;
+    s->m = (floatx *)table_alloc(s->m_n * sizeof(floatx));
+    s->v = (floatx *)table_alloc(s->v_n * sizeof(floatx));
+}
+
+// mean of the squared grads of the touched elements of a row, 0 if none is touched
+floatx row_mean_g2(floatx *grad, int64_t dim)
+{
+    floatx g2 = 0.;
+    int64_t n = 0;
+    for (int64_t j = 0; j < dim; j++)
+    {
+        if (grad[j] != 0.)
+        {
+            g2 += grad[j] * grad[j];
+            n++;
+        }
+    }
+    return n > 0 ? g2 / n : 0.;
+}
+
+// adam with one v per row
+void rowwise_update_row(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row)
+{
+    int64_t start = row * s->dim;
+    floatx *m = s->m + start;
+    floatx beta1 = opt->beta1, beta2 = opt->beta2;
+    param += start;
+    grad += start;
+
+    floatx g2 = row_mean_g2(grad, s->dim);
+    if (g2 == 0. && s->sparse)
+        return;
+    s->v[row] = beta2 * s->v[row] + (1 - beta2) * g2;
+    floatx v_hat = s->v[row] / (1 - opt->beta2t);
+    floatx denom = (floatx)sqrt((floatx)v_hat) + opt->epsilon;
+    for (int64_t j = 0; j < s->dim; j++)
+    {
+        floatx g = grad[j];
+        if (g == 0. && s->sparse)
+            continue;
+        m[j] = beta1 * m[j] + (1 - beta1) * g;
+        grad[j] = 0.;
+
+        floatx m_hat = m[j] / (1 - opt->beta1t);
+        param[j] -= opt->lr_t * m_hat / denom;
+    }
+}
+
+int64_t q8_state_bytes(int64_t rows, int64_t dim)
+{
+    return rows * dim * (sizeof(int8_t) + sizeof(uint8_t)) + rows * ((dim + Q8_BLOCK - 1) / Q8_BLOCK) * 2 * sizeof(floatx);
+}
+
+void q8_init_state(struct opt_state_t *s)
+{
+    s->qm = (int8_t *)table_alloc(s->rows * s->dim * sizeof(int8_t));
+    s->qv = (uint8_t *)table_alloc(s->rows * s->dim * sizeof(uint8_t));
+    s->m_scale = (floatx *)table_alloc(s->rows * s->row_blocks * sizeof(floatx));
+    s->v_scale = (floatx *)table_alloc(s->rows * s->row_blocks * sizeof(floatx));
+}
+
+void q8_load_block(struct opt_state_t *s, int64_t block, int64_t start, floatx *m, floatx *v, int64_t len)
+{
+    floatx m_step = s->m_scale[block] / 127.;
+    floatx v_step = s->v_scale[block] / 255.;
+    for (int64_t k = 0; k < len; k++)
+    {
+        floatx sqrt_v = s->qv[start + k] * v_step;
+        m[k] = s->qm[start + k] * m_step;
+        v[k] = sqrt_v * sqrt_v;
+    }
+}
+
+void q8_store_block(struct opt_state_t *s, int64_t block, int64_t start, floatx *m, floatx *v, int64_t len)
+{
+    floatx m_max = 0., v_max = 0.;
+    for (int64_t k = 0; k < len; k++)
+    {
+        v[k] = (floatx)sqrt(v[k]);
+        m_max = fabsf(m[k]) > m_max ? fabsf(m[k]) : m_max;
+        v_max = v[k] > v_max ? v[k] : v_max;
+    }
+    s->m_scale[block] = m_max;
+    s->v_scale[block] = v_max;
+    for (int64_t k = 0; k < len; k++)
+    {
+        int64_t qv = v_max > 0. ? (int64_t)lrintf(v[k] / v_max * 255.) : 0;
+        int64_t qm = m_max > 0. ? (int64_t)lrintf(m[k] / m_max * 127.) : 0;
+        // v舍入到0时m没有意义，否则下次更新 m / sqrt(v) 会爆炸
+        s->qv[start + k] = (uint8_t)qv;
+        s->qm[start + k] = qv == 0 ? 0 : (int8_t)qm;
+    }
+}
+
+// adam with m and v quantized per block
+void q8_update_row(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row)
+{
+    int64_t start = row * s->dim;
+    floatx beta1 = opt->beta1, beta2 = opt->beta2;
+    floatx m[Q8_BLOCK], v[Q8_BLOCK];
+    int64_t k;
+    param += start;
+    grad += start;
+    // 每个block解码一次，更新后重新量化
+    for (int64_t b = 0; b < s->row_blocks; b++)
+    {
+        int64_t off = b * Q8_BLOCK;
+        int64_t len = s->dim - off < Q8_BLOCK ? s->dim - off : Q8_BLOCK;
+        int64_t block = row * s->row_blocks + b;
+        for (k = 0; k < len; k++)
+            if (grad[off + k] != 0.)
+                break;
+        if (k == len && s->sparse)
+            continue;
+        q8_load_block(s, block, start + off, m, v, len);
+        for (k = 0; k < len; k++)
+        {
+            floatx g = grad[off + k];
+            if (g == 0. && s->sparse)
+                continue;
+            m[k] = beta1 * m[k] + (1 - beta1) * g;
+            v[k] = beta2 * v[k] + (1 - beta2) * g * g;
+            grad[off + k] = 0.;
+
+            floatx m_hat = m[k] / (1 - opt->beta1t);
+            floatx v_hat = v[k] / (1 - opt->beta2t);
+            param[off + k] -= opt->lr_t * m_hat / ((floatx)sqrt((floatx)v_hat) + opt->epsilon);
+        }
+        q8_store_block(s, block, start + off, m, v, len);
+    }
+}
+
+int64_t sgd_state_bytes(int64_t rows, int64_t dim)
+{
+    (void)rows;
+    (void)dim;
+    return 0;
+}
+
+void sgd_init_state(struct opt_state_t *s)
+{
+    (void)s;
+}
+
+void sgd_update_row(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row)
+{
+    int64_t start = row * s->dim;
+    param += start;
+    grad += start;
+    for (int64_t j = 0; j < s->dim; j++)
+    {
+        param[j] -= opt->lr_t * grad[j];
+        grad[j] = 0.;
+    }
+}
+
+int64_t adagrad_state_bytes(int64_t rows, int64_t dim)
+{
+    (void)dim;
+    return rows * sizeof(floatx);
+}
+
+void adagrad_init_state(struct opt_state_t *s)
+{
+    s->v_n = s->rows;
+    s->v = (floatx *)table_alloc(s->v_n * sizeof(floatx));
+}
+
+// row-wise adagrad, v of a row accumulates the mean squared grad of the row
+void adagrad_update_row(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row)
+{
+    int64_t start = row * s->dim;
+    param += start;
+    grad += start;
+
+    floatx g2 = row_mean_g2(grad, s->dim);
+    if (g2 == 0.)
+        return;
+    s->v[row] += g2;
+    floatx step = opt->lr_t / ((floatx)sqrt(s->v[row]) + opt->epsilon);
+    for (int64_t j = 0; j < s->dim; j++)
+    {
+        param[j] -= step * grad[j];
+        grad[j] = 0.;
+    }
+}
+
+int64_t ftrl_state_bytes(int64_t rows, int64_t dim)
+{
+    return 2 * rows * dim * sizeof(floatx);
+}
+
+// ftrl-proximal, m is z and v is n
+void ftrl_update_row(struct optimizer_t *opt, struct opt_state_t *s, floatx *param, floatx *grad, int64_t row)
+{
+    int64_t start = row * s->dim;
+    floatx *z = s->m + start, *n = s->v + start;
+    floatx alpha = opt->lr_t, l1 = opt->l1, l2 = opt->l2;
+    param += start;
+    grad += start;
+    for (int64_t j = 0; j < s->dim; j++)
+    {
+        floatx g = grad[j];
+        if (g == 0.)
+            continue;
+        grad[j] = 0.;
+        // 第一次更新时由当前参数反推z，保留随机初始化的值
+        if (n[j] == 0.)
+            z[j] = -param[j] * (opt->ftrl_beta / alpha + l2) - (param[j] > 0. ? l1 : (param[j] < 0. ? -l1 : 0.));
+
+        floatx n_new = n[j] + g * g;
+        floatx sigma = ((floatx)sqrt(n_new) - (floatx)sqrt(n[j])) / alpha;
+        z[j] += g - sigma * param[j];
+        n[j] = n_new;
+        if (fabsf(z[j]) <= l1)
+            param[j] = 0.;
+        else
+            param[j] = -(z[j] - (z[j] > 0. ? l1 : -l1)) / ((opt->ftrl_beta + (floatx)sqrt(n_new)) / alpha + l2);
+    }
+}
+
+const struct opt_ops_t opt_ops[] = {
+    {"adam", 0.001, adam_state_bytes, adam_init_state, adam_update_row},
+    {"rowwise", 0.001, rowwise_state_bytes, rowwise_init_state, rowwise_update_row},
+    {"q8", 0.001, q8_state_bytes, q8_init_state, q8_update_row},
+    {"sgd", 5., sgd_state_bytes, sgd_init_state, sgd_update_row},
+    {"adagrad", 0.05, adagrad_state_bytes, adagrad_init_state, adagrad_update_row},
+    {"ftrl", 2., ftrl_state_bytes, adam_init_state, ftrl_update_row},
+};
+#define OPT_OPS_NUM ((int64_t)(sizeof(opt_ops) / sizeof(opt_ops[0])))
+
+const struct opt_ops_t *parse_opt(const char *str)
+{
+    if (strcmp(str, "none") == 0)
+        str = "sgd";
+    for (int64_t i = 0; i < OPT_OPS_NUM; i++)
+        if (strcmp(str, opt_ops[i].name) == 0)
+            return &opt_ops[i];
+    printf("error: unknown optimizer %s (adam, rowwise, q8, sgd, adagrad, ftrl)\n", str);
+    exit(-1);
+}
+
+// lr <= 0 means the default lr of the optimizer
+void init_optimizer(struct optimizer_t *opt, const struct opt_ops_t *ops, floatx lr)
+{
+    opt->ops = ops;
+    opt->lr = lr > 0. ? lr : ops->default_lr;
+    opt->lr_t = opt->lr;
+    opt->beta1 = 0.9;
+    opt->beta2 = 0.999;
+    opt->beta1t = opt->beta1;
+    opt->beta2t = opt->beta2;
+    opt->epsilon = 1e-8;
+    opt->ftrl_beta = 1.;
+    opt->l1 = 0.;
+    opt->l2 = 0.;
+}
+
+// called after every batch, step counts from 1
+void optimizer_next_step(struct optimizer_t *opt, int64_t step, int64_t total_steps)
+{
+    // 和原来的实现保持一致 (不是 beta^t)，论文中的结果依赖于这个步长
+    opt->beta1t *= opt->beta1t;
+    opt->beta2t *= opt->beta2t;
+    if (opt->ops->update_row == sgd_update_row)
+        opt->lr_t = opt->lr * (1. - (floatx)step / total_steps);
+}
+
+void init_opt_state(struct opt_state_t *s, const struct opt_ops_t *ops, int64_t rows, int64_t dim, int64_t sparse)
+{
+    memset(s, 0, sizeof(*s));
+    s->sparse = sparse;
+    s->rows = rows;
+    s->dim = dim;
+    s->row_blocks = (dim + Q8_BLOCK - 1) / Q8_BLOCK;
+    ops->init_state(s);
+}
+
+void free_opt_state(struct opt_state_t *s)
+{
+    table_free(s->m, s->m_n * sizeof(floatx));
+    table_free(s->v, s->v_n * sizeof(floatx));
+    if (s->qm != NULL)
+    {
+        table_free(s->qm, s->rows * s->dim * sizeof(int8_t));
+        table_free(s->qv, s->rows * s->dim * sizeof(uint8_t));
+        table_free(s->m_scale, s->rows * s->row_blocks * sizeof(floatx));
+        table_free(s->v_scale, s->rows * s->row_blocks * sizeof(floatx));
+    }
+}
+
+// em states are indexed by the rows of em/em_bi
+void arena_state_rows(struct arena_t *a, struct opt_state_t *s, int64_t group)
+{
+    arena_rows(a, s->m, s->rows, group);
+    arena_rows(a, s->v, s->rows, group);
+    arena_rows(a, s->qm, s->rows, group);
+    arena_rows(a, s->qv, s->rows, group);
+    arena_rows(a, s->m_scale, s->rows, group);
+    arena_rows(a, s->v_scale, s->rows, group);
+}
+
+// upper bound of the arena: the model and the optimizer states, plus a page of padding per table
+int64_t arena_size(int64_t em_dim, int64_t vocab_num, int64_t category_num, const struct opt_ops_t *dense_ops, const struct opt_ops_t *em_ops)
+{
+    int64_t bytes = (2 * em_dim * vocab_num + 2 * em_dim * category_num + category_num) * sizeof(floatx);
+    bytes += 2 * em_ops->state_bytes(vocab_num, em_dim);
+    bytes += 2 * dense_ops->state_bytes(category_num, em_dim) + dense_ops->state_bytes(1, category_num);
+    return bytes + ARENA_MAX_TABLES * sysconf(_SC_PAGESIZE);
+}
+
+void report_memory(struct model_t *model, const struct opt_ops_t *dense_ops, const struct opt_ops_t *em_ops)
+{
+    int64_t em_n = model->em_dim * model->vocab_num;
+    int64_t dense_n = 2 * model->em_dim * model->category_num + model->category_num;
+    int64_t model_bytes = (2 * em_n + dense_n) * sizeof(floatx);
+    int64_t dense_state = 2 * dense_ops->state_bytes(model->category_num, model->em_dim) + dense_ops->state_bytes(1, model->category_num);
+
+    printf("memory (MB):\n");
+    printf("    model: %.1f, grad: %.1f, dense state(%s): %.1f\n",
+           model_bytes / 1048576., model_bytes / 1048576., dense_ops->name, dense_state / 1048576.);
+    for (int64_t k = 0; k < OPT_OPS_NUM; k++)
+    {
+        const struct opt_ops_t *ops = &opt_ops[k];
+        int64_t em_state = 2 * ops->state_bytes(model->vocab_num, model->em_dim);
+        printf("  %c em state(%s): %.2f B/param, %.1f, total: %.1f\n", ops == em_ops ? '*' : ' ', ops->name,
+               em_n > 0 ? (double)em_state / (2 * em_n) : 0., em_state / 1048576., (2 * model_bytes + dense_state + em_state) / 1048576.);
+    }
+}
+
+// dirty rows: 2 * vocab_num bytes, em rows then em_bi rows, set by em_scatter_update
+// each consumer of the changed rows (checkpoint, evaluation snapshot) clears its own bit
+#define DIRTY_CKPT (1)
+#define DIRTY_EVAL (2)
+#define DIRTY_ALL (DIRTY_CKPT | DIRTY_EVAL)
+
+// one em gradient contribution, index is into em (< em_n) or em_bi (- em_n)
+struct em_grad_t
+{
+    int64_t index;
+    floatx g;
+};
+
+// thread team
+// 整个epoch只进入一次parallel区域，各阶段之间用barrier同步
+// 流水线模式下一个parallel区域分成两组线程，每组有自己的barrier，所以不能用 omp barrier / omp for
+struct team_barrier_t
+{
+    int64_t n;
+    int64_t arrived, generation;
+    int64_t spin; // 让出cpu前自旋的次数，线程比核多时不自旋
+};
+
+struct team_t
+{
+    int64_t t, nt; // thread id in the team, team size
+    struct team_barrier_t *bar;
+};
+
+void init_team_barrier(struct team_barrier_t *bar, int64_t n)
+{
+    bar->n = n;
+    bar->arrived = 0;
+    bar->generation = 0;
+    bar->spin = n <= omp_get_num_procs() ? 4096 : 0;
+}
+
+// 最后一个到达的线程重置计数并推进generation，其余线程自旋等待，等太久就让出cpu
+void team_sync(struct team_t *team)
+{
+    struct team_barrier_t *bar = team->bar;
+    if (bar->n == 1)
+        return;
+    int64_t gen = __atomic_load_n(&bar->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&bar->arrived, 1, __ATOMIC_ACQ_REL) == bar->n)
+    {
+        __atomic_store_n(&bar->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&bar->generation, gen + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    for (int64_t spin = 0; __atomic_load_n(&bar->generation, __ATOMIC_ACQUIRE) == gen; spin++)
+    {
+        if (spin >= bar->spin)
+            sched_yield();
+    }
+}
+
+// static split of [0, n) over the team
+static inline void team_range(struct team_t *team, int64_t n, int64_t *start, int64_t *end)
+{
+    *start = n * team->t / team->nt;
+    *end = n * (team->t + 1) / team->nt;
+}
+
+// em的梯度累加和更新合并在一起
+// em和em_bi的行按 row % nt 分给各个线程，每个线程只写自己的行，所以不需要锁
+// 1. 每个线程统计自己负责的样本中属于各个线程的梯度个数
+// 2. 前缀和得到写入位置，按行的归属分桶
+// 3. 每个线程累加自己桶里的梯度，同时记录去重后的行，行的梯度累加完后立即更新
+// team里的每个线程都要调用
+void em_scatter_update(struct model_t *model, struct model_t *gt, struct optimizer_t *opt, struct opt_state_t *em_state, struct opt_state_t *em_bi_state,
+                       int64_t real_batch_size, int64_t *max_fea_indexs, int64_t *max_bi_fea_indexs,
+                       struct stage_t *grads_em, struct stage_t *grads_em_bi, floatx grad_scale, struct em_grad_t *buckets, int64_t *rows, uint8_t *row_mark,
+                       int64_t *counts, uint8_t *dirty_rows, struct team_t *team)
+{
+    int64_t em_dim = model->em_dim;
+    int64_t em_n = em_dim * model->vocab_num;
+    int64_t t = team->t, nt = team->nt;
+    int64_t *count = &counts[t * nt];
+    int64_t j_start, j_end;
+    int64_t batch_j, batch_k, o;
+    team_range(team, real_batch_size, &j_start, &j_end);
+
+    for (o = 0; o < nt; o++)
+        count[o] = 0;
+    for (batch_j = j_start; batch_j < j_end; batch_j++)
+    {
+        for (batch_k = 0; batch_k < em_dim; batch_k++)
+        {
+            count[(max_fea_indexs[batch_j * em_dim + batch_k] / em_dim) % nt]++;
+            count[(max_bi_fea_indexs[2 * batch_j * em_dim + 2 * batch_k] / em_dim) % nt]++;
+            count[(max_bi_fea_indexs[2 * batch_j * em_dim + 2 * batch_k + 1] / em_dim) % nt]++;
+        }
+    }
+    team_sync(team);
+    if (t == 0)
+    {
+        // counts[t][o] -> offset of thread t in bucket o, counts[nt][o] -> start of bucket o
+        int64_t off = 0;
+        for (o = 0; o < nt; o++)
+        {
+            counts[nt * nt + o] = off;
+            for (int64_t u = 0; u < nt; u++)
+            {
+                int64_t c = counts[u * nt + o];
+                counts[u * nt + o] = off;
+                off += c;
+            }
+        }
+        counts[nt * nt + nt] = off;
+    }
+    team_sync(team);
+    for (batch_j = j_start; batch_j < j_end; batch_j++)
+    {
+        for (batch_k = 0; batch_k < em_dim; batch_k++)
+        {
+            int64_t em_index = max_fea_indexs[batch_j * em_dim + batch_k];
+            int64_t em_index0 = max_bi_fea_indexs[2 * batch_j * em_dim + 2 * batch_k];
+            int64_t em_index1 = max_bi_fea_indexs[2 * batch_j * em_dim + 2 * batch_k + 1];
+            floatx g = stage_get(grads_em, batch_j * em_dim + batch_k) * grad_scale;
+            floatx g_bi = 0.5 * stage_get(grads_em_bi, batch_j * em_dim + batch_k) * grad_scale; // take average
+
+            struct em_grad_t *e = &buckets[count[(em_index / em_dim) % nt]++];
+            e->index = em_index;
+            e->g = g;
+            e = &buckets[count[(em_index0 / em_dim) % nt]++];
+            e->index = em_n + em_index0;
+            e->g = g_bi;
+            e = &buckets[count[(em_index1 / em_dim) % nt]++];
+            e->index = em_n + em_index1;
+            e->g = g_bi;
+        }
+    }
+    team_sync(team);
+    int64_t b_start = counts[nt * nt + t], b_end = counts[nt * nt + t + 1];
+    int64_t rows_n = 0;
+    for (int64_t k = b_start; k < b_end; k++)
+    {
+        int64_t index = buckets[k].index;
+        int64_t row = index / em_dim; // em_bi rows follow em rows
+        if (index < em_n)
+            gt->em[index] += buckets[k].g;
+        else
+            gt->em_bi[index - em_n] += buckets[k].g;
+        if (!row_mark[row])
+        {
+            row_mark[row] = 1;
+            rows[b_start + rows_n++] = row;
+        }
+    }
+    for (int64_t k = 0; k < rows_n; k++)
+    {
+        int64_t row = rows[b_start + k];
+        row_mark[row] = 0;
+        if (dirty_rows != NULL)
+            dirty_rows[row] = DIRTY_ALL;
+        if (row < model->vocab_num)
+            opt->ops->update_row(opt, em_state, model->em, gt->em, row);
+        else
+            opt->ops->update_row(opt, em_bi_state, model->em_bi, gt->em_bi, row - model->vocab_num);
+    }
+}
+
+// checkpoint
+// 全量(path): header | tables | shuffle_index | arena[0, used)
+// 增量(path.delta): header | tables | shuffle_index | dense表 | 行数 | 行号 | 每行在各张表里的数据
+// 增量包含上次全量之后改过的所有行，恢复时只需要全量加上最新的增量
+// 训练线程只把上次checkpoint之后改过的em/em_bi行(和dense表)拷到镜像里，后台线程把镜像写盘并fsync
+// 镜像一直保存着上一次checkpoint的完整内容，所以每次只需要拷贝脏行
+#define CKPT_MAGIC "FNTCKPT"
+#define CKPT_VERSION (3)
+#define CKPT_FULL (0)
+#define CKPT_DELTA (1)
+
+struct ckpt_header_t
+{
+    char magic[8];
+    int64_t version, kind;
+    int64_t snapshot_id, base_id; // full: its id, delta: id of the full it applies to
+    int64_t em_dim, vocab_num, category_num, text_num;
+    char dense_opt[16], em_opt[16];
+    int64_t arena_used, tables_n;
+    int64_t epoch, batch; // next batch to train
+    int64_t batch_size, epochs, staleness; // batch is counted in batch_size, total_steps depends on epochs
+    int64_t step, good_steps, skipped_steps;
+    uint64_t seed;
+    double s_loss; // loss sum of the epoch so far
+    floatx loss_scale;
+    struct optimizer_t dense_opt_state, em_opt_state; // ops is not restored
+};
+
+// rows staged by one thread, the data of each row is its bytes in every table of its group, in table order
+struct ckpt_stage_t
+{
+    int64_t *rows;
+    char *data;
+    int64_t rows_n, rows_cap;
+};
+
+struct checkpointer_t
+{
+    const char *path;
+    char delta_path[4096];
+    int64_t every, full_every, count;
+    struct arena_t *arena;
+    char *mirror;
+    int64_t *shuffle_mirror;
+    int64_t text_num;
+    struct ckpt_header_t header;
+    uint8_t *dirty_rows; // shared with the trainer, only DIRTY_CKPT is used here
+    uint8_t *since_full; // rows copied to the mirror since the last full checkpoint
+    int64_t rows_n, full_id;
+    int64_t group_row_bytes[2]; // bytes of an em, em_bi row in all tables of its group
+
+    // epoch结束时写盘线程还在忙: 脏行和dense表拷到暂存区(每个线程一份)，不等写盘
+    // 写盘线程写完上一个之后把暂存区合并进镜像再写，合并之前不会再有新的暂存
+    struct ckpt_stage_t *stages;
+    int64_t stages_n, dense_bytes;
+    char *stage_dense;
+    int64_t *stage_shuffle;
+    struct ckpt_header_t stage_header;
+    int64_t staged;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t pending, stop;
+    double copy_start, stall; // time training waited for checkpoint_copy / checkpoint_stage
+    double stage_stall;
+};
+
+// write the dense tables and the rows of the delta from base, or read them into base
+// rows < vocab_num are em rows, the others em_bi rows
+int64_t delta_rows_io(FILE *fp, struct arena_table_t *tables, int64_t tables_n, int64_t vocab_num, int64_t rows_n, int64_t *rows, char *base, int64_t is_write)
+{
+    int64_t bytes = 0;
+    for (int64_t k = 0; k < tables_n; k++)
+    {
+        if (tables[k].group != ARENA_DENSE)
+            continue;
+        if ((is_write ? fwrite(base + tables[k].offset, 1, tables[k].bytes, fp) : fread(base + tables[k].offset, 1, tables[k].bytes, fp)) != (size_t)tables[k].bytes)
+            return -1;
+        bytes += tables[k].bytes;
+    }
+    for (int64_t i = 0; i < rows_n; i++)
+    {
+        int64_t row = rows[i];
+        if (row < 0 || row >= 2 * vocab_num)
+            return -1;
+        int64_t group = row < vocab_num ? ARENA_EM : ARENA_EM_BI, r = row % vocab_num;
+        for (int64_t k = 0; k < tables_n; k++)
+        {
+            if (tables[k].group != group)
+                continue;
+            int64_t row_bytes = tables[k].bytes / tables[k].rows;
+            char *p = base + tables[k].offset + r * row_bytes;
+            if ((is_write ? fwrite(p, 1, row_bytes, fp) : fread(p, 1, row_bytes, fp)) != (size_t)row_bytes)
+                return -1;
+            bytes += row_bytes;
+        }
+    }
+    return bytes;
+}
+
+void write_checkpoint(struct checkpointer_t *ck)
+{
+    struct ckpt_header_t *header = &ck->header;
+    struct arena_t *a = ck->arena;
+    const char *path = header->kind == CKPT_FULL ? ck->path : ck->delta_path;
+    char tmp_path[4200];
+    double start = omp_get_wtime();
+    int64_t bytes = 0, ok = 1;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        printf("warning: can not open checkpoint file %s\n", tmp_path);
+        return;
+    }
+    ok = fwrite(header, sizeof(*header), 1, fp) == 1 && fwrite(a->tables, sizeof(struct arena_table_t), a->tables_n, fp) == (size_t)a->tables_n &&
+         fwrite(ck->shuffle_mirror, sizeof(int64_t), ck->text_num, fp) == (size_t)ck->text_num;
+    if (ok && header->kind == CKPT_FULL)
+    {
+        ok = fwrite(ck->mirror, 1, a->used, fp) == (size_t)a->used;
+        bytes = a->used;
+    }
+    else if (ok)
+    {
+        int64_t rows_n = 0;
+        int64_t *rows = (int64_t *)malloc(ck->rows_n * sizeof(int64_t));
+        for (int64_t row = 0; row < ck->rows_n; row++)
+            if (ck->since_full[row])
+                rows[rows_n++] = row;
+        ok = fwrite(&rows_n, sizeof(int64_t), 1, fp) == 1 && fwrite(rows, sizeof(int64_t), rows_n, fp) == (size_t)rows_n &&
+             (bytes = delta_rows_io(fp, a->tables, a->tables_n, ck->rows_n / 2, rows_n, rows, ck->mirror, 1)) >= 0;
+        free(rows);
+    }
+    if (!ok || fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        printf("warning: failed to write checkpoint %s\n", tmp_path);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+    if (rename(tmp_path, path) != 0)
+    {
+        printf("warning: can not rename %s to %s\n", tmp_path, path);
+        return;
+    }
+    // 旧的增量对应的是上一个全量，删掉
+    if (header->kind == CKPT_FULL)
+        unlink(ck->delta_path);
+    printf("    checkpoint(%s): epoch %ld batch %ld -> %s (%.1f MB, stall %.1fms, write %.2fs)\n", header->kind == CKPT_FULL ? "full" : "delta",
+           header->epoch, header->batch, path, bytes / 1048576., ck->stall * 1e3, omp_get_wtime() - start);
+}
+
+// move the staged checkpoint into the mirror, called by the writer between two writes
+void checkpoint_merge_stage(struct checkpointer_t *ck)
+{
+    struct arena_t *a = ck->arena;
+    int64_t vocab_num = ck->rows_n / 2, off = 0;
+    ck->header = ck->stage_header;
+    ck->stall = ck->stage_stall;
+    memcpy(ck->shuffle_mirror, ck->stage_shuffle, ck->text_num * sizeof(int64_t));
+    for (int64_t k = 0; k < a->tables_n; k++)
+    {
+        if (a->tables[k].group != ARENA_DENSE)
+            continue;
+        memcpy(ck->mirror + a->tables[k].offset, ck->stage_dense + off, a->tables[k].bytes);
+        off += a->tables[k].bytes;
+    }
+    // 全量之后重新记录改过的行
+    if (ck->header.kind == CKPT_FULL)
+        memset(ck->since_full, 0, ck->rows_n);
+    for (int64_t u = 0; u < ck->stages_n; u++)
+    {
+        struct ckpt_stage_t *st = &ck->stages[u];
+        char *p = st->data;
+        for (int64_t i = 0; i < st->rows_n; i++)
+        {
+            int64_t row = st->rows[i];
+            int64_t group = row < vocab_num ? ARENA_EM : ARENA_EM_BI, r = row % vocab_num;
+            if (ck->header.kind != CKPT_FULL)
+                ck->since_full[row] = 1;
+            for (int64_t k = 0; k < a->tables_n; k++)
+            {
+                struct arena_table_t *table = &a->tables[k];
+                if (table->group != group)
+                    continue;
+                int64_t row_bytes = table->bytes / table->rows;
+                memcpy(ck->mirror + table->offset + r * row_bytes, p, row_bytes);
+                p += row_bytes;
+            }
+        }
+        st->rows_n = 0;
+    }
+}
+
+void *checkpoint_writer(void *arg)
+{
+    struct checkpointer_t *ck = (struct checkpointer_t *)arg;
+    pthread_mutex_lock(&ck->lock);
+    for (;;)
+    {
+        while (!ck->pending && !ck->stop)
+            pthread_cond_wait(&ck->cond, &ck->lock);
+        if (!ck->pending)
+            break;
+        int64_t staged = ck->staged;
+        pthread_mutex_unlock(&ck->lock);
+        if (staged)
+        {
+            // 合并完暂存区就可以再用了
+            checkpoint_merge_stage(ck);
+            pthread_mutex_lock(&ck->lock);
+            ck->staged = 0;
+            pthread_mutex_unlock(&ck->lock);
+        }
+        write_checkpoint(ck);
+        pthread_mutex_lock(&ck->lock);
+        // 写的过程中又暂存了一个，接着写
+        ck->pending = ck->staged;
+        pthread_cond_broadcast(&ck->cond);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+// full_every: every full_every-th checkpoint is a full one, the others are deltas
+// threads_n: the most threads that call checkpoint_copy / checkpoint_stage
+void init_checkpointer(struct checkpointer_t *ck, const char *path, int64_t every, int64_t full_every, struct arena_t *arena, int64_t text_num, int64_t vocab_num,
+                       uint8_t *dirty_rows, int64_t threads_n)
+{
+    memset(ck, 0, sizeof(*ck));
+    ck->path = path;
+    snprintf(ck->delta_path, sizeof(ck->delta_path), "%s.delta", path);
+    ck->every = every;
+    ck->full_every = full_every > 0 ? full_every : 1;
+    ck->arena = arena;
+    ck->text_num = text_num;
+    ck->mirror = (char *)mmap(NULL, arena->used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ck->mirror == MAP_FAILED)
+    {
+        printf("error: can not allocate the checkpoint mirror of %ld bytes", arena->used);
+        exit(-1);
+    }
+    ck->shuffle_mirror = (int64_t *)malloc(text_num * sizeof(int64_t));
+    ck->rows_n = 2 * vocab_num;
+    // 第一次checkpoint要拷贝所有行(dirty_rows初始全为1)，而且是全量
+    ck->dirty_rows = dirty_rows;
+    ck->since_full = (uint8_t *)calloc(ck->rows_n, 1);
+    for (int64_t k = 0; k < arena->tables_n; k++)
+    {
+        struct arena_table_t *table = &arena->tables[k];
+        if (table->group == ARENA_DENSE)
+            ck->dense_bytes += table->bytes;
+        else if (table->group == ARENA_EM || table->group == ARENA_EM_BI)
+            ck->group_row_bytes[table->group == ARENA_EM_BI] += table->bytes / table->rows;
+    }
+    ck->stages_n = threads_n;
+    ck->stages = (struct ckpt_stage_t *)calloc(threads_n, sizeof(struct ckpt_stage_t));
+    ck->stage_dense = (char *)malloc(ck->dense_bytes);
+    ck->stage_shuffle = (int64_t *)malloc(text_num * sizeof(int64_t));
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+    start_helper_thread(&ck->thread, checkpoint_writer, ck);
+}
+
+// wait for the last write and stop the writer
+void free_checkpointer(struct checkpointer_t *ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    ck->stop = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->thread, NULL);
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    munmap(ck->mirror, ck->arena->used);
+    free(ck->shuffle_mirror);
+    free(ck->since_full);
+    for (int64_t u = 0; u < ck->stages_n; u++)
+    {
+        free(ck->stages[u].rows);
+        free(ck->stages[u].data);
+    }
+    free(ck->stages);
+    free(ck->stage_dense);
+    free(ck->stage_shuffle);
+}
+
+// 0: idle, 1: writing, 2: writing and a staged checkpoint is not merged yet
+int64_t checkpoint_busy(struct checkpointer_t *ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    int64_t busy = ck->pending + ck->staged;
+    pthread_mutex_unlock(&ck->lock);
+    return busy;
+}
+
+// wait until the writer has finished the last checkpoint
+void checkpoint_wait(struct checkpointer_t *ck)
+{
+    pthread_mutex_lock(&ck->lock);
+    while (ck->pending)
+        pthread_cond_wait(&ck->cond, &ck->lock);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// kind of the next checkpoint
+int64_t checkpoint_kind(struct checkpointer_t *ck)
+{
+    return ck->count % ck->full_every == 0 ? CKPT_FULL : CKPT_DELTA;
+}
+
+// copy the dirty rows and the dense tables into the mirror, called by every thread of team
+void checkpoint_copy(struct checkpointer_t *ck, struct team_t *team)
+{
+    struct arena_t *a = ck->arena;
+    int64_t vocab_num = ck->rows_n / 2, full = checkpoint_kind(ck) == CKPT_FULL;
+    int64_t r_start, r_end;
+
+    if (team->t == 0)
+    {
+        for (int64_t k = 0; k < a->tables_n; k++)
+            if (a->tables[k].group == ARENA_DENSE)
+                memcpy(ck->mirror + a->tables[k].offset, a->base + a->tables[k].offset, a->tables[k].bytes);
+    }
+    team_range(team, ck->rows_n, &r_start, &r_end);
+    for (int64_t row = r_start; row < r_end; row++)
+    {
+        // 全量之后重新记录改过的行
+        ck->since_full[row] = full ? 0 : ck->since_full[row] | (ck->dirty_rows[row] & DIRTY_CKPT);
+        if (!(ck->dirty_rows[row] & DIRTY_CKPT))
+            continue;
+        ck->dirty_rows[row] &= ~DIRTY_CKPT;
+        int64_t group = row < vocab_num ? ARENA_EM : ARENA_EM_BI, r = row % vocab_num;
+        for (int64_t k = 0; k < a->tables_n; k++)
+        {
+            struct arena_table_t *table = &a->tables[k];
+            if (table->group != group)
+                continue;
+            int64_t row_bytes = table->bytes / table->rows;
+            memcpy(ck->mirror + table->offset + r * row_bytes, a->base + table->offset + r * row_bytes, row_bytes);
+        }
+    }
+}
+
+// copy the dirty rows and the dense tables into the stage of the thread while the writer is busy, called by every thread of team
+// the mirror and since_full belong to the writer until checkpoint_merge_stage
+void checkpoint_stage(struct checkpointer_t *ck, struct team_t *team)
+{
+    struct arena_t *a = ck->arena;
+    struct ckpt_stage_t *st = &ck->stages[team->t];
+    int64_t vocab_num = ck->rows_n / 2, max_row_bytes = ck->group_row_bytes[0] > ck->group_row_bytes[1] ? ck->group_row_bytes[0] : ck->group_row_bytes[1];
+    int64_t r_start, r_end, off = 0;
+
+    if (team->t == 0)
+    {
+        for (int64_t k = 0; k < a->tables_n; k++)
+        {
+            if (a->tables[k].group != ARENA_DENSE)
+                continue;
+            memcpy(ck->stage_dense + off, a->base + a->tables[k].offset, a->tables[k].bytes);
+            off += a->tables[k].bytes;
+        }
     }
-
-    for (int64_t batch_i = 0; batch_i < (vali_data->text_num + batch_size - 1) / batch_size; batch_i++)
+    team_range(team, ck->rows_n, &r_start, &r_end);
+    char *p = st->data;
+    for (int64_t row = r_start; row < r_end; row++)
     {
-        int64_t real_batch_size = (vali_data->text_num - batch_i * batch_size) > batch_size ? batch_size : (vali_data->text_num - batch_i * batch_size);
-        // 可以加速
-#pragma omp parallel for schedule(dynamic) num_threads(threads_n)
-        for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
+        if (!(ck->dirty_rows[row] & DIRTY_CKPT))
+            continue;
+        ck->dirty_rows[row] &= ~DIRTY_CKPT;
+        if (st->rows_n == st->rows_cap)
         {
-            int64_t text_i = (batch_i)*batch_size + batch_j;
-            assert(text_i < vali_data->text_num);
-
-            int64_t text_category = vali_data->text_categories[text_i];
-            // 长度为0的text，不计算梯度
-            // 会导致问题，比如梯度没有更新
-            // 应该在生成数据时避免
-            if (vali_data->text_lens[text_i] == 0)
-            {
-                printf("error: vali text length can not be zero.[text id: %ld]", text_i);
-                exit(-1);
-            }
+            // 暂存区只增不减，之后的epoch不用再分配
+            st->rows_cap = st->rows_cap > 0 ? 2 * st->rows_cap : 1024;
+            st->rows = (int64_t *)realloc(st->rows, st->rows_cap * sizeof(int64_t));
+            int64_t used = p - st->data;
+            st->data = (char *)realloc(st->data, st->rows_cap * max_row_bytes);
+            p = st->data + used;
+        }
+        st->rows[st->rows_n++] = row;
+        int64_t group = row < vocab_num ? ARENA_EM : ARENA_EM_BI, r = row % vocab_num;
+        for (int64_t k = 0; k < a->tables_n; k++)
+        {
+            struct arena_table_t *table = &a->tables[k];
+            if (table->group != group)
+                continue;
+            int64_t row_bytes = table->bytes / table->rows;
+            memcpy(p, a->base + table->offset + r * row_bytes, row_bytes);
+            p += row_bytes;
+        }
+    }
+}
 
-            floatx *max_fea = &max_feas[batch_j * model->em_dim];
-            int64_t *max_fea_index = &max_fea_indexs[batch_j * model->em_dim];
-            floatx *max_bi_fea = &max_bi_feas[batch_j * model->em_dim];
-            int64_t *max_bi_fea_index = &max_bi_fea_indexs[2 * batch_j * model->em_dim];
-            floatx *softmax_fea = &softmax_feas[batch_j * model->category_num];
+// the kind and ids of the next checkpoint, the lock must be held
+void checkpoint_next_header(struct checkpointer_t *ck, struct ckpt_header_t *dst, struct ckpt_header_t *header)
+{
+    *dst = *header;
+    dst->kind = checkpoint_kind(ck);
+    if (dst->kind == CKPT_FULL)
+        ck->full_id = header->step;
+    dst->snapshot_id = header->step;
+    dst->base_id = ck->full_id;
+    ck->count++;
+}
 
-            int64_t *pre_label = &pre_labels[batch_j];
-            int64_t *real_label = &real_labels[batch_j];
+// hand the mirror to the writer, called by one thread after checkpoint_copy
+void checkpoint_submit(struct checkpointer_t *ck, struct ckpt_header_t *header, int64_t *shuffle_index)
+{
+    memcpy(ck->shuffle_mirror, shuffle_index, ck->text_num * sizeof(int64_t));
+    pthread_mutex_lock(&ck->lock);
+    ck->stall = omp_get_wtime() - ck->copy_start;
+    checkpoint_next_header(ck, &ck->header, header);
+    ck->pending = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+}
 
-            *real_label = text_category;
+// hand the stages to the writer, called by one thread after checkpoint_stage
+void checkpoint_submit_stage(struct checkpointer_t *ck, struct ckpt_header_t *header, int64_t *shuffle_index)
+{
+    memcpy(ck->stage_shuffle, shuffle_index, ck->text_num * sizeof(int64_t));
+    pthread_mutex_lock(&ck->lock);
+    // 写盘线程可能正在用stall，合并时再换过去
+    ck->stage_stall = omp_get_wtime() - ck->copy_start;
+    checkpoint_next_header(ck, &ck->stage_header, header);
+    ck->staged = 1;
+    ck->pending = 1;
+    pthread_cond_broadcast(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+}
 
-            forward(model, vali_data, text_i, max_fea, max_fea_index, max_bi_fea, max_bi_fea_index, softmax_fea);
-            *pre_label = 0;
-            floatx fea = softmax_fea[0];
-            for (int64_t c = 1; c < model->category_num; c++)
-            {
-                if (softmax_fea[c] > fea)
-                {
-                    *pre_label = c;
-                    fea = softmax_fea[c];
-                }
-            }
-        }
+// open a checkpoint file and read its header and table layout, NULL if it does not exist
+FILE *open_checkpoint(const char *path, struct ckpt_header_t *header, struct arena_table_t *tables)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    if (fread(header, sizeof(*header), 1, fp) != 1 || memcmp(header->magic, CKPT_MAGIC, sizeof(CKPT_MAGIC)) != 0 || header->version != CKPT_VERSION ||
+        header->tables_n < 0 || header->tables_n > ARENA_MAX_TABLES || fread(tables, sizeof(struct arena_table_t), header->tables_n, fp) != (size_t)header->tables_n)
+    {
+        printf("error: %s is not a checkpoint (version %d)", path, CKPT_VERSION);
+        exit(-1);
+    }
+    return fp;
+}
 
-        // 访问临界资源
-        for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
-        {
-            cat_all[real_labels[batch_j]] += 1;
-            if (real_labels[batch_j] == pre_labels[batch_j])
-                cat_true[real_labels[batch_j]] += 1;
-        }
+// read the full checkpoint at path, and its delta if there is one, into base/shuffle_index
+// header is the one of the newest file
+void read_checkpoint(const char *path, struct ckpt_header_t *header, struct arena_table_t *tables, char *base, int64_t *shuffle_index)
+{
+    char delta_path[4200];
+    struct ckpt_header_t delta;
+    struct arena_table_t delta_tables[ARENA_MAX_TABLES];
+    FILE *fp = open_checkpoint(path, header, tables);
+    if (fp == NULL)
+    {
+        printf("error: can not open checkpoint %s", path);
+        exit(-1);
     }
-    floatx cat_all_sum = 0.;
-    floatx cat_true_sum = 0.;
-    for (int64_t k = 0; k < model->category_num; k++)
+    if (header->kind != CKPT_FULL || fread(shuffle_index, sizeof(int64_t), header->text_num, fp) != (size_t)header->text_num ||
+        fread(base, 1, header->arena_used, fp) != (size_t)header->arena_used)
     {
-        cat_all_sum += cat_all[k];
-        cat_true_sum += cat_true[k];
+        printf("error: checkpoint %s is truncated or not a full checkpoint", path);
+        exit(-1);
     }
+    fclose(fp);
 
-    printf("#samples: %.0f\n", cat_all_sum);
-    FILE *fp = fopen("fntext_bi_10_500.txt", "a");
-    printf("macro precision: %.5f\n", cat_true_sum / cat_all_sum);
-    fprintf(fp, "macro precision: %.5f\n", cat_true_sum / cat_all_sum);
-    for (int64_t k = 0; k < model->category_num; k++)
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", path);
+    if ((fp = open_checkpoint(delta_path, &delta, delta_tables)) == NULL)
+        return;
+    if (delta.base_id != header->snapshot_id || delta.tables_n != header->tables_n || memcmp(delta_tables, tables, header->tables_n * sizeof(struct arena_table_t)) != 0)
     {
-        printf("   category #%ld precision: %.5f\n", k, cat_true[k] / cat_all[k]);
-        fprintf(fp, "   category #%ld precision: %.5f\n", k, cat_true[k] / cat_all[k]);
+        printf("warning: %s does not belong to %s, ignore it\n", delta_path, path);
+        fclose(fp);
+        return;
+    }
+    int64_t rows_n = 0;
+    int64_t *rows = NULL;
+    if (fread(shuffle_index, sizeof(int64_t), delta.text_num, fp) != (size_t)delta.text_num || fread(&rows_n, sizeof(int64_t), 1, fp) != 1 || rows_n < 0 ||
+        rows_n > 2 * delta.vocab_num || (rows = (int64_t *)malloc((rows_n + 1) * sizeof(int64_t))) == NULL ||
+        fread(rows, sizeof(int64_t), rows_n, fp) != (size_t)rows_n || delta_rows_io(fp, tables, header->tables_n, delta.vocab_num, rows_n, rows, base, 0) < 0)
+    {
+        printf("error: checkpoint %s is truncated", delta_path);
+        exit(-1);
     }
+    free(rows);
     fclose(fp);
+    printf("applied %s: %ld rows\n", delta_path, rows_n);
+    *header = delta;
+}
 
-    free(max_feas);
-    free(max_fea_indexs);
-    free(max_bi_feas);
-    free(max_bi_fea_indexs);
-    free(softmax_feas);
+// merge path and path.delta into a new full checkpoint at path
+void compact_checkpoint(const char *path)
+{
+    struct ckpt_header_t header;
+    struct arena_table_t tables[ARENA_MAX_TABLES];
+    char tmp_path[4200], delta_path[4200];
+    FILE *fp = open_checkpoint(path, &header, tables);
+    if (fp == NULL)
+    {
+        printf("error: can not open checkpoint %s", path);
+        exit(-1);
+    }
+    fclose(fp);
+    char *base = (char *)malloc(header.arena_used);
+    int64_t *shuffle_index = (int64_t *)malloc(header.text_num * sizeof(int64_t));
+    read_checkpoint(path, &header, tables, base, shuffle_index);
+    if (header.kind == CKPT_FULL)
+    {
+        printf("%s has no delta, nothing to compact\n", path);
+        free(base);
+        free(shuffle_index);
+        return;
+    }
+    header.kind = CKPT_FULL;
+    header.snapshot_id = header.base_id = header.step;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL || fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(tables, sizeof(struct arena_table_t), header.tables_n, fp) != (size_t)header.tables_n ||
+        fwrite(shuffle_index, sizeof(int64_t), header.text_num, fp) != (size_t)header.text_num || fwrite(base, 1, header.arena_used, fp) != (size_t)header.arena_used ||
+        fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+    {
+        printf("error: can not write %s", tmp_path);
+        exit(-1);
+    }
+    fclose(fp);
+    if (rename(tmp_path, path) != 0)
+    {
+        printf("error: can not rename %s to %s", tmp_path, path);
+        exit(-1);
+    }
+    unlink(delta_path);
+    printf("compacted %s: epoch %ld batch %ld, %.1f MB\n", path, header.epoch, header.batch, header.arena_used / 1048576.);
+    free(base);
+    free(shuffle_index);
+}
 
-    free(pre_labels);
-    free(real_labels);
-    free(cat_all);
-    free(cat_true);
+// background evaluation
+// 每个epoch结束时把模型拷到一份快照里，后台线程在快照上评估，同时训练下一个epoch
+// 快照只拷贝上次之后改过的em/em_bi行(DIRTY_EVAL)和dense表，上一次评估还没结束时先等它
+struct evaluator_t
+{
+    struct model_t snapshot;
+    struct dataset_t *data;
+    struct eval_buffers_t buffers;
+    int64_t split_len;
+    uint8_t *dirty_rows; // shared with the trainer, only DIRTY_EVAL is used here
+    floatx *cat_all, *cat_true;
+    int64_t epoch; // epoch of the snapshot
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t pending, stop;
+    double submit_time;
+};
 
-    eva_end = time(NULL);
-    printf("   evaluating time: %lds\n", eva_end - eva_start);
+void *evaluator_thread(void *arg)
+{
+    struct evaluator_t *ev = (struct evaluator_t *)arg;
+    char tag[64];
+    pthread_mutex_lock(&ev->lock);
+    for (;;)
+    {
+        while (!ev->pending && !ev->stop)
+            pthread_cond_wait(&ev->cond, &ev->lock);
+        if (!ev->pending)
+            break;
+        pthread_mutex_unlock(&ev->lock);
+        double start = omp_get_wtime();
+        evaluate_counts(&ev->snapshot, ev->data, &ev->buffers, ev->split_len, ev->cat_all, ev->cat_true);
+        snprintf(tag, sizeof(tag), "vali epoch %ld (background, %.2fs after the epoch)", ev->epoch, omp_get_wtime() - ev->submit_time);
+        report_eval(tag, ev->snapshot.category_num, ev->cat_all, ev->cat_true, omp_get_wtime() - start);
+        pthread_mutex_lock(&ev->lock);
+        ev->pending = 0;
+        pthread_cond_broadcast(&ev->cond);
+    }
+    pthread_mutex_unlock(&ev->lock);
+    return NULL;
 }
 
-void train_adam(struct model_t *model, struct dataset_t *train_data, struct dataset_t *vali_data, int64_t epochs, int64_t batch_size, int64_t threads_n)
+void init_evaluator(struct evaluator_t *ev, struct model_t *model, struct dataset_t *data, int64_t eval_batch_size, int64_t threads_n, int64_t split_len,
+                    uint8_t *dirty_rows)
 {
-    printf("start training(Adam)...\n");
-    //     omp_lock_t omplock;
-    // omp_init_lock(&omplock);
+    memset(ev, 0, sizeof(*ev));
+    // 快照不属于checkpoint，不放在arena里
+    struct arena_t *arena = table_arena;
+    table_arena = NULL;
+    init_model(&ev->snapshot, model->em_dim, model->vocab_num, model->category_num, 0);
+    table_arena = arena;
+    ev->data = data;
+    init_eval_buffers(&ev->buffers, model->em_dim, model->category_num, eval_batch_size, threads_n);
+    ev->split_len = split_len;
+    ev->dirty_rows = dirty_rows;
+    ev->cat_all = (floatx *)malloc(model->category_num * sizeof(floatx));
+    ev->cat_true = (floatx *)malloc(model->category_num * sizeof(floatx));
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+    start_helper_thread(&ev->thread, evaluator_thread, ev);
+}
 
-    int64_t tmp, i, sel;
+// wait for the last evaluation, returns the seconds waited
+double evaluator_wait(struct evaluator_t *ev)
+{
+    double start = omp_get_wtime();
+    pthread_mutex_lock(&ev->lock);
+    while (ev->pending)
+        pthread_cond_wait(&ev->cond, &ev->lock);
+    pthread_mutex_unlock(&ev->lock);
+    return omp_get_wtime() - start;
+}
 
-    floatx alpha = 0.001, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
-    floatx beta1t = beta1;
-    floatx beta2t = beta2;
+// finish the last evaluation and stop the thread
+void free_evaluator(struct evaluator_t *ev)
+{
+    pthread_mutex_lock(&ev->lock);
+    ev->stop = 1;
+    pthread_cond_broadcast(&ev->cond);
+    pthread_mutex_unlock(&ev->lock);
+    pthread_join(ev->thread, NULL);
+    pthread_mutex_destroy(&ev->lock);
+    pthread_cond_destroy(&ev->cond);
+    free_model(&ev->snapshot);
+    free_eval_buffers(&ev->buffers);
+    free(ev->cat_all);
+    free(ev->cat_true);
+}
 
-    int64_t *shuffle_index = (int64_t *)malloc(train_data->text_num * sizeof(int64_t));
+// copy the changed rows of model into the snapshot and start evaluating it, the evaluator must be idle
+void evaluator_submit(struct evaluator_t *ev, struct model_t *model, int64_t epoch, int64_t threads_n)
+{
+    struct model_t *snap = &ev->snapshot;
+    int64_t em_dim = model->em_dim, vocab_num = model->vocab_num;
+    memcpy(snap->w, model->w, em_dim * model->category_num * sizeof(floatx));
+    memcpy(snap->w_bi, model->w_bi, em_dim * model->category_num * sizeof(floatx));
+    memcpy(snap->b, model->b, model->category_num * sizeof(floatx));
+#pragma omp parallel for schedule(static) num_threads(threads_n)
+    for (int64_t row = 0; row < 2 * vocab_num; row++)
+    {
+        if (!(ev->dirty_rows[row] & DIRTY_EVAL))
+            continue;
+        ev->dirty_rows[row] &= ~DIRTY_EVAL;
+        if (row < vocab_num)
+            memcpy(&snap->em[row * em_dim], &model->em[row * em_dim], em_dim * sizeof(floatx));
+        else
+            memcpy(&snap->em_bi[(row - vocab_num) * em_dim], &model->em_bi[(row - vocab_num) * em_dim], em_dim * sizeof(floatx));
+    }
+    pthread_mutex_lock(&ev->lock);
+    ev->epoch = epoch;
+    ev->submit_time = omp_get_wtime();
+    ev->pending = 1;
+    pthread_cond_broadcast(&ev->cond);
+    pthread_mutex_unlock(&ev->lock);
+}
 
-    struct model_t adam_m, adam_v, gt;
-    init_model(&adam_m, model->em_dim, model->vocab_num, model->category_num, 0);
-    init_model(&adam_v, model->em_dim, model->vocab_num, model->category_num, 0);
-    init_model(&gt, model->em_dim, model->vocab_num, model->category_num, 0);
+struct train_config_t
+{
+    int64_t epochs, batch_size, threads_n;
+    const struct opt_ops_t *dense_ops, *em_ops;
+    floatx lr;          // <= 0: default lr of the optimizer
+    int64_t bf16;       // keep per-sample activations and gradients in bf16
+    floatx loss_scale;  // > 0: scale the loss, skip the batch and halve the scale on overflow
+    int64_t staleness;  // > 0: compute batch k + staleness while batch k is applied
+    int64_t split_len;  // texts longer than this are pooled in parts on several threads
+    const char *checkpoint_path; // write a checkpoint every checkpoint_every batches
+    int64_t checkpoint_every, checkpoint_full_every;
+    const char *resume_path;
+    int64_t eval_threads; // > 0: evaluate the vali data on a snapshot with this many threads while training goes on
+    int64_t eval_batch_size;
+};
 
-    floatx *grads_em = (floatx *)malloc(model->em_dim * batch_size * sizeof(floatx));
-    floatx *grads_em_bi = (floatx *)malloc(model->em_dim * batch_size * sizeof(floatx));
-    floatx *grads_w = (floatx *)malloc(model->em_dim * model->category_num * batch_size * sizeof(floatx));
-    floatx *grads_w_bi = (floatx *)malloc(model->em_dim * model->category_num * batch_size * sizeof(floatx));
-    floatx *grads_b = (floatx *)malloc(model->category_num * batch_size * sizeof(floatx));
+// buffers of one batch between forward/backward and the update
+struct batch_slot_t
+{
+    int64_t batch_i, real_batch_size, overflow;
+    struct task_queue_t queue;      // pooling tasks of the batch
+    floatx loss_scale, grad_scale;  // loss scale when the batch was computed
+    struct stage_t grads_em, grads_em_bi, max_feas, max_bi_feas;
+    int64_t *max_fea_indexs, *max_bi_fea_indexs;
+    floatx *softmax_feas, *losses;
+    floatx *grads_b;    // per sample, loss scaled
+    floatx *dense_grad; // [w | w_bi | b] of the whole batch, already scaled
+};
 
-    floatx *max_feas = (floatx *)malloc(model->em_dim * batch_size * sizeof(floatx));
-    int64_t *max_fea_indexs = (int64_t *)malloc(model->em_dim * batch_size * sizeof(int64_t));
-    floatx *max_bi_feas = (floatx *)malloc(model->em_dim * batch_size * sizeof(floatx));
-    int64_t *max_bi_fea_indexs = (int64_t *)malloc(2 * model->em_dim * batch_size * sizeof(int64_t));
-    floatx *softmax_feas = (floatx *)malloc(model->category_num * batch_size * sizeof(floatx));
-    floatx *losses = (floatx *)malloc(batch_size * sizeof(floatx));
+struct trainer_t
+{
+    struct train_config_t *cfg;
+    struct model_t *model;
+    struct dataset_t *train_data;
+    int64_t *shuffle_index;
+
+    struct model_t gt;
+    struct optimizer_t dense_opt, em_opt;
+    struct opt_state_t w_state, w_bi_state, b_state, em_state, em_bi_state;
+    floatx loss_scale;
+    int64_t step, total_steps, good_steps, skipped_steps;
+
+    // buffers of em_scatter_update
+    struct em_grad_t *em_buckets;
+    int64_t *em_rows, *em_counts;
+    uint8_t *em_row_mark;
+
+    // number of elements of [w | w_bi | b]
+    int64_t dense_n;
+    // float scratch of one sample per thread: [max_fea | max_bi_fea | grad_em | grad_em_bi] only used with bf16
+    int64_t scratch_n;
+    floatx *scratches;
+
+    // staleness + 1 slots, batch k uses slots[k % slots_n]
+    int64_t slots_n;
+    struct batch_slot_t *slots;
+    // copy of w, w_bi, b read by forward/backward while the update runs
+    floatx *dense_snapshot;
+
+    // rows changed since the last checkpoint / evaluation snapshot
+    uint8_t *dirty_rows;
+    int64_t ckpt_on, ckpt_go, ckpt_stage;
+    struct checkpointer_t ckpt;
+    int64_t eval_on, vali_on;
+    struct evaluator_t eval;
+    struct eval_buffers_t eval_buffers; // vali data without eval_on
+};
 
-    printf("init grad end...\n");
+void init_trainer(struct trainer_t *tr, struct train_config_t *cfg, struct model_t *model, struct dataset_t *train_data, struct dataset_t *vali_data)
+{
+    int64_t batch_size = cfg->batch_size, threads_n = cfg->threads_n;
+    int64_t em_dim = model->em_dim, category_num = model->category_num;
+    int64_t i;
 
+    tr->cfg = cfg;
+    tr->model = model;
+    tr->train_data = train_data;
+    tr->shuffle_index = (int64_t *)malloc(train_data->text_num * sizeof(int64_t));
     for (i = 0; i < train_data->text_num; i++)
-        shuffle_index[i] = i;
+        tr->shuffle_index[i] = i;
+
+    // 梯度表不属于checkpoint，不放在arena里
+    struct arena_t *arena = table_arena;
+    table_arena = NULL;
+    init_model(&tr->gt, em_dim, model->vocab_num, category_num, 0);
+    table_arena = arena;
+    init_optimizer(&tr->dense_opt, cfg->dense_ops, cfg->lr);
+    init_optimizer(&tr->em_opt, cfg->em_ops, cfg->lr);
+    init_opt_state(&tr->w_state, cfg->dense_ops, category_num, em_dim, 0);
+    init_opt_state(&tr->w_bi_state, cfg->dense_ops, category_num, em_dim, 0);
+    init_opt_state(&tr->b_state, cfg->dense_ops, 1, category_num, 0);
+    init_opt_state(&tr->em_state, cfg->em_ops, model->vocab_num, em_dim, 1);
+    init_opt_state(&tr->em_bi_state, cfg->em_ops, model->vocab_num, em_dim, 1);
+    arena_state_rows(table_arena, &tr->em_state, ARENA_EM);
+    arena_state_rows(table_arena, &tr->em_bi_state, ARENA_EM_BI);
+    tr->loss_scale = cfg->loss_scale > 0. ? cfg->loss_scale : 1.;
+    tr->step = tr->good_steps = tr->skipped_steps = 0;
+
+    tr->em_buckets = (struct em_grad_t *)malloc(3 * em_dim * batch_size * sizeof(struct em_grad_t));
+    tr->em_rows = (int64_t *)malloc(3 * em_dim * batch_size * sizeof(int64_t));
+    tr->em_row_mark = (uint8_t *)calloc(2 * model->vocab_num, sizeof(uint8_t));
+    tr->em_counts = (int64_t *)malloc((threads_n + 1) * (threads_n + 1) * sizeof(int64_t));
+
+    tr->dense_n = 2 * em_dim * category_num + category_num;
+    tr->scratch_n = 4 * em_dim;
+    tr->scratches = (floatx *)malloc(threads_n * tr->scratch_n * sizeof(floatx));
+
+    tr->slots_n = cfg->staleness + 1;
+    tr->slots = (struct batch_slot_t *)calloc(tr->slots_n, sizeof(struct batch_slot_t));
+    for (i = 0; i < tr->slots_n; i++)
+    {
+        struct batch_slot_t *slot = &tr->slots[i];
+        init_stage(&slot->grads_em, em_dim * batch_size, cfg->bf16);
+        init_stage(&slot->grads_em_bi, em_dim * batch_size, cfg->bf16);
+        init_stage(&slot->max_feas, em_dim * batch_size, cfg->bf16);
+        init_stage(&slot->max_bi_feas, em_dim * batch_size, cfg->bf16);
+        slot->max_fea_indexs = (int64_t *)malloc(em_dim * batch_size * sizeof(int64_t));
+        slot->max_bi_fea_indexs = (int64_t *)malloc(2 * em_dim * batch_size * sizeof(int64_t));
+        slot->softmax_feas = (floatx *)malloc(category_num * batch_size * sizeof(floatx));
+        slot->losses = (floatx *)malloc(batch_size * sizeof(floatx));
+        slot->grads_b = (floatx *)malloc(category_num * batch_size * sizeof(floatx));
+        slot->dense_grad = (floatx *)calloc(tr->dense_n, sizeof(floatx));
+        init_task_queue(&slot->queue, batch_size, em_dim, threads_n);
+    }
+    tr->dense_snapshot = cfg->staleness > 0 ? (floatx *)malloc(tr->dense_n * sizeof(floatx)) : NULL;
+    tr->ckpt_on = cfg->checkpoint_path != NULL && cfg->checkpoint_every > 0;
+    tr->eval_on = vali_data != NULL && cfg->eval_threads > 0;
+    // 一开始所有行都要拷贝
+    tr->dirty_rows = NULL;
+    if (tr->ckpt_on || tr->eval_on)
+    {
+        tr->dirty_rows = (uint8_t *)malloc(2 * model->vocab_num);
+        memset(tr->dirty_rows, DIRTY_ALL, 2 * model->vocab_num);
+    }
+    if (tr->ckpt_on)
+        init_checkpointer(&tr->ckpt, cfg->checkpoint_path, cfg->checkpoint_every, cfg->checkpoint_full_every, table_arena, train_data->text_num, model->vocab_num,
+                          tr->dirty_rows, cfg->threads_n + 1);
+    if (tr->eval_on)
+        init_evaluator(&tr->eval, model, vali_data, cfg->eval_batch_size, cfg->eval_threads, cfg->split_len, tr->dirty_rows);
+    else if (vali_data != NULL)
+        init_eval_buffers(&tr->eval_buffers, em_dim, category_num, cfg->eval_batch_size, threads_n);
+    tr->vali_on = vali_data != NULL;
+
+    int64_t stage_n = tr->slots_n * 4 * em_dim * batch_size;
+    printf("staging buffers: %.1f MB (%s, %ld slots)\n", stage_n * (cfg->bf16 ? sizeof(bf16) : sizeof(floatx)) / 1048576.,
+           cfg->bf16 ? "bf16" : "float", tr->slots_n);
+}
+
+void free_trainer(struct trainer_t *tr)
+{
+    free(tr->shuffle_index);
+    free_model(&tr->gt);
+    free_opt_state(&tr->w_state);
+    free_opt_state(&tr->w_bi_state);
+    free_opt_state(&tr->b_state);
+    free_opt_state(&tr->em_state);
+    free_opt_state(&tr->em_bi_state);
+    free(tr->em_buckets);
+    free(tr->em_rows);
+    free(tr->em_row_mark);
+    free(tr->em_counts);
+    free(tr->scratches);
+    for (int64_t i = 0; i < tr->slots_n; i++)
+    {
+        struct batch_slot_t *slot = &tr->slots[i];
+        free_stage(&slot->grads_em);
+        free_stage(&slot->grads_em_bi);
+        free_stage(&slot->max_feas);
+        free_stage(&slot->max_bi_feas);
+        free(slot->max_fea_indexs);
+        free(slot->max_bi_fea_indexs);
+        free(slot->softmax_feas);
+        free(slot->losses);
+        free(slot->grads_b);
+        free(slot->dense_grad);
+        free_task_queue(&slot->queue);
+    }
+    free(tr->slots);
+    free(tr->dense_snapshot);
+    if (tr->ckpt_on)
+        free_checkpointer(&tr->ckpt);
+    if (tr->eval_on)
+        free_evaluator(&tr->eval);
+    else if (tr->vali_on)
+        free_eval_buffers(&tr->eval_buffers);
+    free(tr->dirty_rows);
+}
 
-    for (int64_t epoch = 0; epoch < epochs; epoch++)
+void fill_checkpoint_header(struct trainer_t *tr, struct ckpt_header_t *header, int64_t epoch, int64_t batch, floatx s_loss)
+{
+    struct model_t *model = tr->model;
+    int64_t batch_num = (tr->train_data->text_num + tr->cfg->batch_size - 1) / tr->cfg->batch_size;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CKPT_MAGIC, sizeof(CKPT_MAGIC));
+    header->version = CKPT_VERSION;
+    header->em_dim = model->em_dim;
+    header->vocab_num = model->vocab_num;
+    header->category_num = model->category_num;
+    header->text_num = tr->train_data->text_num;
+    strncpy(header->dense_opt, tr->cfg->dense_ops->name, sizeof(header->dense_opt) - 1);
+    strncpy(header->em_opt, tr->cfg->em_ops->name, sizeof(header->em_opt) - 1);
+    header->arena_used = table_arena->used;
+    header->tables_n = table_arena->tables_n;
+    header->batch_size = tr->cfg->batch_size;
+    header->epochs = tr->cfg->epochs;
+    header->staleness = tr->cfg->staleness;
+    header->epoch = batch < batch_num ? epoch : epoch + 1;
+    header->batch = batch < batch_num ? batch : 0;
+    header->step = tr->step;
+    header->good_steps = tr->good_steps;
+    header->skipped_steps = tr->skipped_steps;
+    header->seed = rng_seed;
+    header->s_loss = batch < batch_num ? s_loss : 0.;
+    header->loss_scale = tr->loss_scale;
+    header->dense_opt_state = tr->dense_opt;
+    header->em_opt_state = tr->em_opt;
+}
+
+// restore the parameters, optimizer states and the position in the data written by a checkpoint
+void load_checkpoint(struct trainer_t *tr, const char *path, int64_t *epoch, int64_t *batch, floatx *s_loss)
+{
+    struct ckpt_header_t header, expect;
+    struct arena_table_t tables[ARENA_MAX_TABLES];
+    struct arena_t *arena = table_arena;
+    FILE *fp = open_checkpoint(path, &header, tables);
+    if (fp == NULL)
     {
-        printf("#epoch: %ld\n", epoch);
-        floatx s_loss = 0.;
-        time_t epoch_start, epoch_end;
-        // clock_t epoch_start, epoch_end;
-        // shuffle
-        for (i = 0; i < train_data->text_num; i++)
+        printf("error: can not open checkpoint %s", path);
+        exit(-1);
+    }
+    fclose(fp);
+    fill_checkpoint_header(tr, &expect, 0, 0, 0.);
+    if (header.em_dim != expect.em_dim || header.vocab_num != expect.vocab_num || header.category_num != expect.category_num ||
+        header.text_num != expect.text_num || strcmp(header.dense_opt, expect.dense_opt) != 0 || strcmp(header.em_opt, expect.em_opt) != 0 ||
+        header.arena_used != expect.arena_used || header.tables_n != expect.tables_n ||
+        memcmp(tables, arena->tables, header.tables_n * sizeof(struct arena_table_t)) != 0)
+    {
+        printf("error: checkpoint %s does not match the run (dim %ld, vocab %ld, category %ld, texts %ld, opt %s, em opt %s)", path,
+               header.em_dim, header.vocab_num, header.category_num, header.text_num, header.dense_opt, header.em_opt);
+        exit(-1);
+    }
+    // 位置按batch数记录，学习率的衰减按总步数算，换了这些就不能接着训练
+    if (header.batch_size != expect.batch_size || header.epochs != expect.epochs || header.staleness != expect.staleness)
+    {
+        printf("error: checkpoint %s was written with -batch-size %ld -epoch %ld -staleness %ld, resume with the same values", path,
+               header.batch_size, header.epochs, header.staleness);
+        exit(-1);
+    }
+    read_checkpoint(path, &header, tables, arena->base, tr->shuffle_index);
+
+    const struct opt_ops_t *dense_ops = tr->dense_opt.ops, *em_ops = tr->em_opt.ops;
+    tr->dense_opt = header.dense_opt_state;
+    tr->dense_opt.ops = dense_ops;
+    tr->em_opt = header.em_opt_state;
+    tr->em_opt.ops = em_ops;
+    tr->step = header.step;
+    tr->good_steps = header.good_steps;
+    tr->skipped_steps = header.skipped_steps;
+    tr->loss_scale = header.loss_scale;
+    rng_seed = header.seed;
+    *epoch = header.epoch;
+    *batch = header.batch;
+    *s_loss = header.s_loss;
+    printf("resume from %s: epoch %ld, batch %ld, step %ld\n", path, header.epoch, header.batch, header.step);
+}
+
+
+// set up slot for batch batch_i, called by one thread before the team of nt threads starts on it
+void prepare_batch(struct trainer_t *tr, struct batch_slot_t *slot, int64_t batch_i, int64_t nt)
+{
+    int64_t batch_size = tr->cfg->batch_size, text_num = tr->train_data->text_num;
+    slot->batch_i = batch_i;
+    slot->real_batch_size = (text_num - batch_i * batch_size) > batch_size ? batch_size : (text_num - batch_i * batch_size);
+    slot->overflow = 0;
+    slot->loss_scale = tr->loss_scale;
+    slot->grad_scale = 1. / ((floatx)batch_size * tr->loss_scale);
+    build_pool_tasks(&slot->queue, tr->train_data, &tr->shuffle_index[batch_i * batch_size], slot->real_batch_size,
+                     2 * tr->model->category_num, tr->cfg->split_len, nt);
+}
+
+// forward/backward of sample batch_j, a long text is pooled from its parts
+void compute_sample(struct trainer_t *tr, struct model_t *model, struct batch_slot_t *slot, int64_t batch_j, struct pool_task_t *task, floatx *scratch)
+{
+    struct dataset_t *train_data = tr->train_data;
+    int64_t em_dim = model->em_dim, category_num = model->category_num;
+    struct task_queue_t *q = &slot->queue;
+
+    int64_t text_i = (slot->batch_i) * tr->cfg->batch_size + batch_j;
+    assert(text_i < train_data->text_num);
+    text_i = tr->shuffle_index[text_i];
+
+    // 长度为0的text，不计算梯度
+    // 会导致问题，比如梯度没有更新
+    // 应该在生成数据时避免
+    if (train_data->text_lens[text_i] == 0)
+    {
+        printf("error: training text length can not be zero.[text id: %ld]", text_i);
+        exit(-1);
+    }
+
+    floatx *max_fea = stage_ptr(&slot->max_feas, batch_j * em_dim, scratch);
+    floatx *max_bi_fea = stage_ptr(&slot->max_bi_feas, batch_j * em_dim, scratch + em_dim);
+    floatx *grad_em = stage_ptr(&slot->grads_em, batch_j * em_dim, scratch + 2 * em_dim);
+    floatx *grad_em_bi = stage_ptr(&slot->grads_em_bi, batch_j * em_dim, scratch + 3 * em_dim);
+    floatx *grad_b = &slot->grads_b[batch_j * category_num];
+
+    int64_t *max_fea_index = &slot->max_fea_indexs[batch_j * em_dim];
+    int64_t *max_bi_fea_index = &slot->max_bi_fea_indexs[2 * batch_j * em_dim];
+    floatx *softmax_fea = &slot->softmax_feas[batch_j * category_num];
+
+    if (task->parts == 0)
+        slot->losses[batch_j] = forward(model, train_data, text_i, max_fea, max_fea_index, max_bi_fea, max_bi_fea_index, softmax_fea);
+    else
+    {
+        pool_parts(q, task, max_fea, max_fea_index, max_bi_fea, max_bi_fea_index);
+        slot->losses[batch_j] = forward_head(model, train_data->text_categories[text_i], max_fea, max_bi_fea, softmax_fea);
+    }
+    // backward看到的是舍入到bf16之后的特征
+    stage_commit(&slot->max_feas, batch_j * em_dim, max_fea, em_dim);
+    stage_commit(&slot->max_bi_feas, batch_j * em_dim, max_bi_fea, em_dim);
+    backward(model, train_data, text_i, softmax_fea, grad_em, grad_em_bi, grad_b, slot->loss_scale);
+    stage_commit(&slot->grads_em, batch_j * em_dim, grad_em, em_dim);
+    stage_commit(&slot->grads_em_bi, batch_j * em_dim, grad_em_bi, em_dim);
+
+    // w/w_bi/b的梯度在compute_batch合并之后检查
+    if (tr->cfg->loss_scale > 0.)
+    {
+        floatx sum = 0.;
+        for (int64_t k = 0; k < em_dim; k++)
+            sum += grad_em[k] + grad_em_bi[k];
+        if (!isfinite(sum))
+            __atomic_store_n(&slot->overflow, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// forward/backward of the batch in slot, called by every thread of team
+// model may be a snapshot view of tr->model
+void compute_batch(struct trainer_t *tr, struct model_t *model, struct batch_slot_t *slot, struct team_t *team)
+{
+    struct dataset_t *train_data = tr->train_data;
+    struct task_queue_t *q = &slot->queue;
+    int64_t em_dim = model->em_dim, category_num = model->category_num;
+    int64_t w_n = 2 * em_dim * category_num;
+    floatx *dense_grad = slot->dense_grad;
+    floatx grad_scale = slot->grad_scale;
+    int64_t t = team->t, nt = team->nt;
+    floatx *scratch = &tr->scratches[t * tr->scratch_n];
+    int64_t k_start, k_end, task_i;
+
+    while ((task_i = next_pool_task(q, t, nt)) >= 0)
+    {
+        struct pool_task_t *task = &q->tasks[task_i];
+        if (task->parts == 0)
         {
-            sel = rand() % (train_data->text_num - i) + i;
-            tmp = shuffle_index[i];
-            shuffle_index[i] = shuffle_index[sel];
-            shuffle_index[sel] = tmp;
+            for (int64_t batch_j = task->j_start; batch_j < task->j_end; batch_j++)
+                compute_sample(tr, model, slot, batch_j, task, scratch);
+            continue;
         }
+        // 长文本的一段，最后完成的那段负责合并和backward
+        int64_t text_i = tr->shuffle_index[slot->batch_i * tr->cfg->batch_size + task->j_start];
+        if (pool_part(q, task, model, train_data, text_i, 1))
+            compute_sample(tr, model, slot, task->j_start, task, scratch);
+    }
+    team_sync(team);
 
-        epoch_start = time(NULL);
-        // epoch_start = clock();
-        for (int64_t batch_i = 0; batch_i < (train_data->text_num + batch_size - 1) / batch_size; batch_i++)
+    // w, w_bi, b的梯度: 所有线程按元素分工，每个元素按batch_j的顺序累加
+    // 样本由哪个线程计算、线程有多少都不影响结果
+    team_range(team, tr->dense_n, &k_start, &k_end);
+    memset(&dense_grad[k_start], 0, (k_end - k_start) * sizeof(floatx));
+    for (int64_t batch_j = 0; batch_j < slot->real_batch_size; batch_j++)
+    {
+        const floatx *grad_b = &slot->grads_b[batch_j * category_num];
+        const floatx *max_fea = stage_load(&slot->max_feas, batch_j * em_dim, scratch, em_dim);
+        const floatx *max_bi_fea = stage_load(&slot->max_bi_feas, batch_j * em_dim, scratch + em_dim, em_dim);
+        int64_t k = k_start;
+        // w, w_bi的第row行是 fea * grad_b[row % category_num]，一段可能从行中间开始
+        while (k < k_end && k < w_n)
         {
-            int64_t real_batch_size = (train_data->text_num - batch_i * batch_size) > batch_size ? batch_size : (train_data->text_num - batch_i * batch_size);
-            // 可以加速
-#pragma omp parallel for schedule(dynamic) num_threads(threads_n)
-            for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
-            {
-                int64_t text_i = (batch_i)*batch_size + batch_j;
-                assert(text_i < train_data->text_num);
-                text_i = shuffle_index[text_i];
-
-                // 长度为0的text，不计算梯度
-                // 会导致问题，比如梯度没有更新
-                // 应该在生成数据时避免
-                if (train_data->text_lens[text_i] == 0)
-                {
-                    printf("error: training text length can not be zero.[text id: %ld]", text_i);
-                    exit(-1);
-                }
+            int64_t row = k / em_dim, col = k - row * em_dim;
+            int64_t end = (row + 1) * em_dim < k_end ? (row + 1) * em_dim : k_end;
+            const floatx *fea = row < category_num ? max_fea : max_bi_fea;
+            floatx g = grad_b[row % category_num];
+            for (; k < end; k++, col++)
+                dense_grad[k] += fea[col] * g;
+        }
+        for (; k < k_end; k++)
+            dense_grad[k] += grad_b[k - w_n];
+    }
+    // 每个线程只读写自己那段元素，这里不需要barrier
+    floatx sum = 0.;
+    for (int64_t k = k_start; k < k_end; k++)
+    {
+        dense_grad[k] *= grad_scale;
+        sum += dense_grad[k];
+    }
+    if (tr->cfg->loss_scale > 0. && !isfinite(sum))
+        __atomic_store_n(&slot->overflow, 1, __ATOMIC_RELAXED);
+}
 
-                floatx *grad_em = &grads_em[batch_j * model->em_dim];
-                floatx *grad_em_bi = &grads_em_bi[batch_j * model->em_dim];
-                floatx *grad_w = &grads_w[batch_j * model->em_dim * model->category_num];
-                floatx *grad_w_bi = &grads_w_bi[batch_j * model->em_dim * model->category_num];
-                floatx *grad_b = &grads_b[batch_j * model->category_num];
+// apply the gradients of slot to tr->model, called by every thread of team
+void update_batch(struct trainer_t *tr, struct batch_slot_t *slot, struct team_t *team)
+{
+    struct model_t *model = tr->model;
+    const struct opt_ops_t *dense_ops = tr->cfg->dense_ops;
+    int64_t em_dim = model->em_dim, category_num = model->category_num;
+    int64_t c_start, c_end;
+
+    // em的梯度累加和更新，按行分给各个线程
+    em_scatter_update(model, &tr->gt, &tr->em_opt, &tr->em_state, &tr->em_bi_state, slot->real_batch_size, slot->max_fea_indexs, slot->max_bi_fea_indexs,
+                      &slot->grads_em, &slot->grads_em_bi, slot->grad_scale, tr->em_buckets, tr->em_rows, tr->em_row_mark, tr->em_counts,
+                      tr->dirty_rows, team);
+
+    // w, w_bi每行是一个类别，更新时清零dense_grad
+    team_range(team, category_num, &c_start, &c_end);
+    for (int64_t c = c_start; c < c_end; c++)
+    {
+        dense_ops->update_row(&tr->dense_opt, &tr->w_state, model->w, slot->dense_grad, c);
+        dense_ops->update_row(&tr->dense_opt, &tr->w_bi_state, model->w_bi, slot->dense_grad + em_dim * category_num, c);
+    }
+    if (team->t == team->nt - 1)
+        dense_ops->update_row(&tr->dense_opt, &tr->b_state, model->b, slot->dense_grad + 2 * em_dim * category_num, 0);
+}
 
-                floatx *max_fea = &max_feas[batch_j * model->em_dim];
-                int64_t *max_fea_index = &max_fea_indexs[batch_j * model->em_dim];
-                floatx *max_bi_fea = &max_bi_feas[batch_j * model->em_dim];
-                int64_t *max_bi_fea_index = &max_bi_fea_indexs[2 * batch_j * model->em_dim];
-                floatx *softmax_fea = &softmax_feas[batch_j * model->category_num];
+// bookkeeping after the update of slot, called by one thread
+void finish_batch(struct trainer_t *tr, struct batch_slot_t *slot, floatx *s_loss)
+{
+    if (slot->overflow)
+    {
+        // 梯度溢出，跳过这个batch
+        tr->loss_scale *= 0.5;
+        tr->good_steps = 0;
+        tr->skipped_steps++;
+        memset(slot->dense_grad, 0, tr->dense_n * sizeof(floatx));
+        printf("    warning: gradient overflow, skip batch, loss scale: %g\n", tr->loss_scale);
+        return;
+    }
 
-                losses[batch_j] = forward(model, train_data, text_i, max_fea, max_fea_index, max_bi_fea, max_bi_fea_index, softmax_fea);
-                backward(model, train_data, text_i, max_fea, max_bi_fea, softmax_fea, grad_em, grad_em_bi, grad_w, grad_w_bi, grad_b);
-            }
+    // 跳过的batch不计入loss
+    for (int64_t batch_j = 0; batch_j < slot->real_batch_size; batch_j++)
+        *s_loss += slot->losses[batch_j];
 
-            for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
-                s_loss += losses[batch_j];
+    tr->step++;
+    optimizer_next_step(&tr->dense_opt, tr->step, tr->total_steps);
+    optimizer_next_step(&tr->em_opt, tr->step, tr->total_steps);
 
-            // 把多个batch的梯度累加起来 不可以加速，因为gt.em是临界资源
-            for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
-            {
-                for (int64_t batch_k = 0; batch_k < model->em_dim * model->category_num; batch_k++)
-                    gt.w[batch_k] += grads_w[batch_j * model->em_dim * model->category_num + batch_k] / (floatx)batch_size;
-                // bi
-                for (int64_t batch_k = 0; batch_k < model->em_dim * model->category_num; batch_k++)
-                    gt.w_bi[batch_k] += grads_w_bi[batch_j * model->em_dim * model->category_num + batch_k] / (floatx)batch_size;
-                for (int64_t batch_k = 0; batch_k < model->category_num; batch_k++)
-                    gt.b[batch_k] += grads_b[batch_j * model->category_num + batch_k] / (floatx)batch_size;
-                // em的grad 特殊对待
-                for (int64_t batch_k = 0; batch_k < model->em_dim; batch_k++)
-                {
-                    int64_t em_index = max_fea_indexs[batch_j * model->em_dim + batch_k];
-                    gt.em[em_index] += grads_em[batch_j * model->em_dim + batch_k] / (floatx)batch_size;
-
-                    // bi
-                    int64_t em_index0 = max_bi_fea_indexs[2 * batch_j * model->em_dim + 2 * batch_k];
-                    int64_t em_index1 = max_bi_fea_indexs[2 * batch_j * model->em_dim + 2 * batch_k + 1];
-                    gt.em_bi[em_index0] += 0.5 * grads_em_bi[batch_j * model->em_dim + batch_k] / (floatx)batch_size;  // take average
-                    gt.em_bi[em_index1] += 0.5 * grads_em_bi[batch_j * model->em_dim + batch_k] / (floatx)batch_size;  // take average
-                }
-            }
+    // 连续2000个batch没有溢出，放大loss scale
+    if (tr->cfg->loss_scale > 0. && ++tr->good_steps == 2000)
+    {
+        tr->loss_scale *= 2.;
+        tr->good_steps = 0;
+    }
+}
 
-                // 计算m,v update param 可以加速
-#pragma omp parallel for schedule(static) num_threads(threads_n)
-            for (int64_t batch_k = 0; batch_k < model->em_dim * model->category_num; batch_k++)
-            {
-                adam_m.w[batch_k] = beta1 * adam_m.w[batch_k] + (1 - beta1) * gt.w[batch_k];
-                adam_v.w[batch_k] = beta2 * adam_v.w[batch_k] + (1 - beta2) * gt.w[batch_k] * gt.w[batch_k];
-                gt.w[batch_k] = 0.;
-
-                floatx m_hat = adam_m.w[batch_k] / (1 - beta1t);
-                floatx v_hat = adam_v.w[batch_k] / (1 - beta2t);
-                model->w[batch_k] -= alpha * m_hat / ((floatx)sqrt((floatx)v_hat) + epsilon);
-
-                // bi
-                adam_m.w_bi[batch_k] = beta1 * adam_m.w_bi[batch_k] + (1 - beta1) * gt.w_bi[batch_k];
-                adam_v.w_bi[batch_k] = beta2 * adam_v.w_bi[batch_k] + (1 - beta2) * gt.w_bi[batch_k] * gt.w_bi[batch_k];
-                gt.w_bi[batch_k] = 0.;
-
-                m_hat = adam_m.w_bi[batch_k] / (1 - beta1t);
-                v_hat = adam_v.w_bi[batch_k] / (1 - beta2t);
-                model->w_bi[batch_k] -= alpha * m_hat / ((floatx)sqrt((floatx)v_hat) + epsilon);
-            }
+void train(struct model_t *model, struct dataset_t *train_data, struct dataset_t *vali_data, struct train_config_t *cfg)
+{
+    int64_t batch_size = cfg->batch_size, threads_n = cfg->threads_n, staleness = cfg->staleness;
+    int64_t em_dim = model->em_dim, category_num = model->category_num;
+    printf("start training(%s, em: %s%s)...\n", cfg->dense_ops->name, cfg->em_ops->name, cfg->bf16 ? ", bf16" : "");
+    //     omp_lock_t omplock;
+    // omp_init_lock(&omplock);
 
-            // 循环数量少，不用加速
-            for (int64_t batch_k = 0; batch_k < model->category_num; batch_k++)
-            {
-                adam_m.b[batch_k] = beta1 * adam_m.b[batch_k] + (1 - beta1) * gt.b[batch_k];
-                adam_v.b[batch_k] = beta2 * adam_v.b[batch_k] + (1 - beta2) * gt.b[batch_k] * gt.b[batch_k];
-                gt.b[batch_k] = 0.;
+    int64_t batch_num = (train_data->text_num + batch_size - 1) / batch_size;
+
+    struct trainer_t tr;
+    init_trainer(&tr, cfg, model, train_data, vali_data);
+    tr.total_steps = cfg->epochs * batch_num;
+    printf("lr: %g, em lr: %g\n", tr.dense_opt.lr, tr.em_opt.lr);
+    int64_t start_epoch = 0, start_batch = 0;
+    floatx resume_loss = 0.;
+    if (cfg->resume_path != NULL)
+        load_checkpoint(&tr, cfg->resume_path, &start_epoch, &start_batch, &resume_loss);
+    // 优化器状态和梯度表只有被访问的页才占物理内存，记录训练过程中rss的增长
+    int64_t rss_start = rss_bytes();
+    printf("rss: %.1f MB\n", rss_start / 1048576.);
+
+    // 流水线: 更新batch k的同时计算batch k + staleness
+    // forward/backward读w, w_bi, b的快照，em和em_bi直接读，可能已经包含了部分更新
+    // 线程 [0, update_threads) 做更新，其余线程做forward/backward
+    int64_t update_threads = threads_n / 4 > 1 ? threads_n / 4 : 1;
+    int64_t compute_threads = threads_n - update_threads > 1 ? threads_n - update_threads : 1;
+    int64_t team_n = staleness > 0 ? update_threads + compute_threads : threads_n;
+    struct team_barrier_t update_bar, compute_bar;
+    struct model_t view = *model;
+    init_team_barrier(&update_bar, staleness > 0 ? update_threads : threads_n);
+    init_team_barrier(&compute_bar, compute_threads);
+    if (staleness > 0)
+    {
+        view.w = tr.dense_snapshot;
+        view.w_bi = tr.dense_snapshot + em_dim * category_num;
+        view.b = tr.dense_snapshot + 2 * em_dim * category_num;
+        printf("pipeline: staleness %ld, %ld compute threads, %ld update threads\n", staleness, compute_threads, update_threads);
+    }
 
-                floatx m_hat = adam_m.b[batch_k] / (1 - beta1t);
-                floatx v_hat = adam_v.b[batch_k] / (1 - beta2t);
-                model->b[batch_k] -= alpha * m_hat / ((floatx)sqrt((floatx)v_hat) + epsilon);
+    printf("init grad end...\n");
+
+    for (int64_t epoch = start_epoch; epoch < cfg->epochs; epoch++)
+    {
+        printf("#epoch: %ld\n", epoch);
+        // 从checkpoint恢复时，这个epoch已经shuffle过，从start_batch继续
+        int64_t first_batch = epoch == start_epoch ? start_batch : 0;
+        floatx s_loss = epoch == start_epoch ? resume_loss : 0.;
+        double epoch_start, epoch_end;
+        // shuffle
+        if (first_batch == 0)
+            shuffle_index(tr.shuffle_index, train_data->text_num, RNG_SHUFFLE + epoch, threads_n);
+
+        epoch_start = omp_get_wtime();
+        // 整个epoch只有一个parallel区域
+        // 每个batch: 线程0准备 -> barrier -> 计算/更新 -> barrier -> 线程0记账
+        // 每个epoch结束时排空流水线
+#pragma omp parallel num_threads(team_n)
+        {
+            if (omp_get_num_threads() != team_n)
+            {
+                printf("error: got %d threads instead of %ld", omp_get_num_threads(), team_n);
+                exit(-1);
             }
+            int64_t t = omp_get_thread_num();
+            struct team_t update_team = {t, staleness > 0 ? update_threads : threads_n, &update_bar};
+            struct team_t compute_team = {staleness > 0 ? t - update_threads : t, compute_threads, &compute_bar};
+            if (staleness == 0)
+                compute_team = update_team;
 
-            // adam_m,adam_v,model->em, gt.em是临界资源
-            for (int64_t batch_j = 0; batch_j < real_batch_size; batch_j++)
+            for (int64_t k = first_batch; k < batch_num + staleness; k++)
             {
-                // em的grad 特殊对待
-                for (int64_t batch_k = 0; batch_k < model->em_dim; batch_k++)
+                int64_t compute_i = k < batch_num ? k : -1;
+                int64_t update_i = k - staleness;
+                struct batch_slot_t *compute_slot = &tr.slots[k % tr.slots_n];
+                struct batch_slot_t *update_slot = &tr.slots[(k + tr.slots_n - staleness % tr.slots_n) % tr.slots_n];
+
+                if (t == 0 && compute_i >= 0)
                 {
-                    int64_t em_index = max_fea_indexs[batch_j * model->em_dim + batch_k];
-                    if (gt.em[em_index] != 0.)
+                    // 同步模式下所有线程都做forward/backward，任务按实际的计算线程数切分
+                    prepare_batch(&tr, compute_slot, compute_i, compute_team.nt);
+                    if (staleness > 0)
                     {
-                        adam_m.em[em_index] = beta1 * adam_m.em[em_index] + (1 - beta1) * gt.em[em_index];
-                        adam_v.em[em_index] = beta2 * adam_v.em[em_index] + (1 - beta2) * gt.em[em_index] * gt.em[em_index];
-                        gt.em[em_index] = 0.;
-
-                        floatx m_hat = adam_m.em[em_index] / (1 - beta1t);
-                        floatx v_hat = adam_v.em[em_index] / (1 - beta2t);
-                        model->em[em_index] -= alpha * m_hat / ((floatx)sqrt((floatx)v_hat) + epsilon);
+                        memcpy(tr.dense_snapshot, model->w, em_dim * category_num * sizeof(floatx));
+                        memcpy(tr.dense_snapshot + em_dim * category_num, model->w_bi, em_dim * category_num * sizeof(floatx));
+                        memcpy(tr.dense_snapshot + 2 * em_dim * category_num, model->b, category_num * sizeof(floatx));
                     }
+                }
+#pragma omp barrier
+
+                if (staleness == 0)
+                {
+                    compute_batch(&tr, model, compute_slot, &compute_team);
+                    // compute_batch最后每个线程只处理自己那段dense_grad，更新前要等所有线程
+                    team_sync(&update_team);
+                    if (!compute_slot->overflow)
+                        update_batch(&tr, compute_slot, &update_team);
+                }
+                else if (t < update_threads)
+                {
+                    if (update_i >= 0 && !update_slot->overflow)
+                        update_batch(&tr, update_slot, &update_team);
+                }
+                else if (compute_i >= 0)
+                    compute_batch(&tr, &view, compute_slot, &compute_team);
+#pragma omp barrier
 
-                    // bi
-                    int64_t em_index0 = max_bi_fea_indexs[2 * batch_j * model->em_dim + 2 * batch_k];
-                    int64_t em_index1 = max_bi_fea_indexs[2 * batch_j * model->em_dim + 2 * batch_k + 1];
+                if (t == 0 && update_i >= 0)
+                    finish_batch(&tr, update_slot, &s_loss);
 
-                    if (gt.em_bi[em_index0] != 0.)
+                // checkpoint: 所有线程把脏行拷到镜像，线程0交给后台线程写盘
+                // 每个epoch结束时都做，流水线模式下只在epoch结束、流水线排空时做
+                if (tr.ckpt_on && update_i >= 0 && ((staleness == 0 && (update_i + 1) % cfg->checkpoint_every == 0) || update_i == batch_num - 1))
+                {
+                    if (t == 0)
                     {
-                        adam_m.em_bi[em_index0] = beta1 * adam_m.em_bi[em_index0] + (1 - beta1) * gt.em_bi[em_index0];
-                        adam_v.em_bi[em_index0] = beta2 * adam_v.em_bi[em_index0] + (1 - beta2) * gt.em_bi[em_index0] * gt.em_bi[em_index0];
-                        gt.em_bi[em_index0] = 0.;
-
-                        floatx m_hat = adam_m.em_bi[em_index0] / (1 - beta1t);
-                        floatx v_hat = adam_v.em_bi[em_index0] / (1 - beta2t);
-                        model->em_bi[em_index0] -= alpha * m_hat / ((floatx)sqrt((floatx)v_hat) + epsilon);
+                        // 上一次还没写完: 批次中间的跳过，脏行留到下一次；epoch结束时拷到暂存区，写盘线程写完上一个再写它
+                        // 暂存的还没合并时(一次写盘比一个epoch还长)才等写盘线程
+                        tr.ckpt.copy_start = omp_get_wtime();
+                        int64_t busy = checkpoint_busy(&tr.ckpt);
+                        if (busy == 2 && update_i == batch_num - 1)
+                        {
+                            checkpoint_wait(&tr.ckpt);
+                            busy = 0;
+                        }
+                        tr.ckpt_go = busy == 0;
+                        tr.ckpt_stage = busy != 0 && update_i == batch_num - 1;
+                        if (!tr.ckpt_go && !tr.ckpt_stage)
+                            printf("    warning: checkpoint writer is busy, skip batch %ld\n", update_i);
                     }
-                    if (gt.em_bi[em_index1] != 0.)
+#pragma omp barrier
+                    struct team_t all_team = {t, team_n, NULL};
+                    if (tr.ckpt_go)
+                        checkpoint_copy(&tr.ckpt, &all_team);
+                    else if (tr.ckpt_stage)
+                        checkpoint_stage(&tr.ckpt, &all_team);
+#pragma omp barrier
+                    if (t == 0 && (tr.ckpt_go || tr.ckpt_stage))
                     {
-                        adam_m.em_bi[em_index1] = beta1 * adam_m.em_bi[em_index1] + (1 - beta1) * gt.em_bi[em_index1];
-                        adam_v.em_bi[em_index1] = beta2 * adam_v.em_bi[em_index1] + (1 - beta2) * gt.em_bi[em_index1] * gt.em_bi[em_index1];
-                        gt.em_bi[em_index1] = 0.;
-
-                        floatx m_hat = adam_m.em_bi[em_index1] / (1 - beta1t);
-                        floatx v_hat = adam_v.em_bi[em_index1] / (1 - beta2t);
-                        model->em_bi[em_index1] -= alpha * m_hat / ((floatx)sqrt((floatx)v_hat) + epsilon);
+                        struct ckpt_header_t header;
+                        fill_checkpoint_header(&tr, &header, epoch, update_i + 1, s_loss);
+                        if (tr.ckpt_go)
+                            checkpoint_submit(&tr.ckpt, &header, tr.shuffle_index);
+                        else
+                            checkpoint_submit_stage(&tr.ckpt, &header, tr.shuffle_index);
                     }
                 }
-            }
-
-            beta1t *= beta1t;
-            beta2t *= beta2t;
-
-        } // end_batch
-        epoch_end = time(NULL);
-        // epoch_end = clock();
+            } // end_batch
+        }
+        epoch_end = omp_get_wtime();
 
         s_loss /= train_data->text_num;
         printf("    loss: %.4f\n", s_loss);
-        printf("    time: %lds\n", epoch_end - epoch_start);
-        // printf("    time: %.1fs\n", (double)(epoch_end - epoch_start)/CLOCKS_PER_SEC );
+        printf("    time: %.2fs (%s, em: %s)\n", epoch_end - epoch_start, cfg->dense_ops->name, cfg->em_ops->name);
+        if (cfg->loss_scale > 0.)
+            printf("    loss scale: %g, skipped batches: %ld\n", tr.loss_scale, tr.skipped_steps);
+        printf("    rss: %.1f MB (+%.1f MB)\n", rss_bytes() / 1048576., (rss_bytes() - rss_start) / 1048576.);
 
-        if (vali_data != NULL)
+        if (tr.eval_on)
+        {
+            double stall = evaluator_wait(&tr.eval);
+            double copy_start = omp_get_wtime();
+            evaluator_submit(&tr.eval, model, epoch, threads_n);
+            printf("    vali: snapshot of epoch %ld (waited %.2fs for the last evaluation, copy %.1fms)\n", epoch, stall, (omp_get_wtime() - copy_start) * 1e3);
+        }
+        else if (vali_data != NULL)
         {
+            char tag[64];
+            snprintf(tag, sizeof(tag), "vali epoch %ld", epoch);
             printf("evaluate vali data...\n");
-            evaluate(model, vali_data, batch_size, threads_n);
+            evaluate(model, vali_data, &tr.eval_buffers, cfg->split_len, tag);
         }
 
         printf("\n");
 
     } //end_epoch
-    free(shuffle_index);
-    free_model(&adam_m);
-    free_model(&adam_v);
-    free_model(&gt);
-    free(grads_em);
-    free(grads_em_bi);
-    free(grads_w);
-    free(grads_w_bi);
-    free(grads_b);
-    free(max_feas);
-    free(max_fea_indexs);
-    free(max_bi_feas);
-    free(max_bi_fea_indexs);
-    free(softmax_feas);
-    free(losses);
+    free_trainer(&tr);
+}
+
+// pin the threads of a team of threads_n, affinity is "none", "compact" (fill node 0 first) or "scatter" (round robin over the nodes)
+// the cpus left over go to the background threads, returns their number, -1 if the threads are not pinned
+int64_t pin_threads(const char *affinity, int64_t threads_n)
+{
+    if (strcmp(affinity, "none") == 0)
+        return -1;
+    if (strcmp(affinity, "compact") != 0 && strcmp(affinity, "scatter") != 0)
+    {
+        printf("error: unknown affinity %s (none, compact, scatter)\n", affinity);
+        exit(-1);
+    }
+    int64_t nodes = numa_nodes(), procs = omp_get_num_procs(), n = 0;
+    int *node_cpus = (int *)malloc(nodes * procs * sizeof(int));
+    int64_t *node_n = (int64_t *)malloc(nodes * sizeof(int64_t));
+    int *order = (int *)malloc(nodes * procs * sizeof(int));
+    for (int64_t k = 0; k < nodes; k++)
+        node_n[k] = numa_node_cpus(k, &node_cpus[k * procs], procs);
+    if (affinity[0] == 'c')
+    {
+        for (int64_t k = 0; k < nodes; k++)
+            for (int64_t c = 0; c < node_n[k]; c++)
+                order[n++] = node_cpus[k * procs + c];
+    }
+    else
+    {
+        for (int64_t c = 0; c < procs; c++)
+            for (int64_t k = 0; k < nodes; k++)
+                if (c < node_n[k])
+                    order[n++] = node_cpus[k * procs + c];
+    }
+
+    // libgomp之后的并行区域会复用这些线程
+#pragma omp parallel num_threads(threads_n)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(order[omp_get_thread_num() % n], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            printf("warning: can not pin thread %d to cpu %d\n", omp_get_thread_num(), order[omp_get_thread_num() % n]);
+    }
+    // 主线程是训练的0号线程，之后创建的后台线程不能继承它的affinity
+    CPU_ZERO(&helper_cpus);
+    for (int64_t k = threads_n < n ? threads_n : 0; k < n; k++)
+        CPU_SET(order[k], &helper_cpus);
+    helper_cpus_n = CPU_COUNT(&helper_cpus);
+    int64_t free_n = n > threads_n ? n - threads_n : 0;
+    printf("pinned %ld threads (%s, %ld nodes, %ld cpus, %ld free for background threads)\n", threads_n, affinity, nodes, n, free_n);
+    free(node_cpus);
+    free(node_n);
+    free(order);
+    return free_n;
+}
+
+// time of the pooling loop with the threads of node cpu_node and the table on node mem_node
+// 每个组合用一个线程跑pool_range，报告每个token的时间
+void numa_bench(int64_t em_dim, int64_t vocab_num)
+{
+    int64_t nodes = numa_nodes(), procs = omp_get_num_procs();
+    int64_t rows = vocab_num, text_len = 512, texts_n = 2000;
+    // 表太大时只测前面一部分，仍然远大于cache
+    if (rows * em_dim * (int64_t)sizeof(floatx) > ((int64_t)1 << 30))
+        rows = ((int64_t)1 << 30) / (em_dim * sizeof(floatx));
+    int64_t bytes = rows * em_dim * sizeof(floatx);
+    int *cpus = (int *)malloc(procs * sizeof(int));
+    int64_t *tokens = (int64_t *)malloc(text_len * texts_n * sizeof(int64_t));
+    floatx *max_fea = (floatx *)malloc(2 * em_dim * sizeof(floatx));
+    int64_t *max_fea_index = (int64_t *)malloc(3 * em_dim * sizeof(int64_t));
+    uint64_t x = 88172645463325252ull;
+    for (int64_t i = 0; i < text_len * texts_n; i++)
+    {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        tokens[i] = x % rows;
+    }
+    cpu_set_t old_set;
+    sched_getaffinity(0, sizeof(old_set), &old_set);
+
+    printf("numa bench: %ld nodes, table %.1f MB, ns per token (rows: cpu node, columns: memory node)\n", nodes, bytes / 1048576.);
+    for (int64_t c = 0; c < nodes; c++)
+    {
+        int64_t cpus_n = numa_node_cpus(c, cpus, procs);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int64_t k = 0; k < cpus_n; k++)
+            CPU_SET(cpus[k], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+        printf("  node %ld:", c);
+        for (int64_t m = 0; m < nodes; m++)
+        {
+            floatx *table = (floatx *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (table == MAP_FAILED)
+            {
+                printf("error: can not allocate %ld bytes", bytes);
+                exit(-1);
+            }
+            if (nodes > 1)
+                numa_bind(table, bytes, MPOL_PREFERRED, 1ull << m);
+            for (int64_t i = 0; i < rows * em_dim; i++)
+                table[i] = (floatx)(i % 1000) * 1e-5;
+            struct model_t view = {0};
+            view.em = view.em_bi = table;
+            view.em_dim = em_dim;
+            view.vocab_num = rows;
+            double start = omp_get_wtime();
+            for (int64_t k = 0; k < texts_n; k++)
+                pool_range(&view, &tokens[k * text_len], text_len, 0, text_len, max_fea, max_fea_index, max_fea + em_dim, max_fea_index + em_dim);
+            double used = omp_get_wtime() - start;
+            printf(" %8.1f%s", used * 1e9 / (text_len * texts_n), m == c ? "*" : " ");
+            munmap(table, bytes);
+        }
+        printf("\n");
+    }
+    printf("  (* local)\n");
+    sched_setaffinity(0, sizeof(old_set), &old_set);
+    free(cpus);
+    free(tokens);
+    free(max_fea);
+    free(max_fea_index);
 }
+
 void show(int64_t *a, int64_t n)
 {
     for (int64_t i = 0; i < n; i++)
@@ -754,9 +3332,14 @@ int main(int argc, char **argv)
     struct dataset_t train_data, vali_data, test_data;
 
     int64_t em_dim = 200, vocab_num = 0, category_num = 0, em_len = 0;
-    int64_t epochs = 10, batch_size = 2000, threads_n = 20;
-    floatx lr = 0.5, limit_vocab=1.;
+    int64_t epochs = 10, batch_size = 2000, threads_n = 20, bf16 = 0, staleness = 0, split_len = SPLIT_TOKENS;
+    floatx lr = 0., limit_vocab=1., loss_scale = 0.;
+    const struct opt_ops_t *dense_ops = parse_opt("adam"), *em_ops = NULL;
+    const char *affinity = "none", *checkpoint_path = NULL, *resume_path = NULL;
+    int64_t checkpoint_every = 1000, checkpoint_full_every = 10, eval_threads = -1, eval_batch_size = 8192;
     char *train_data_path = NULL, *vali_data_path = NULL, *test_data_path = NULL, *em_path = NULL;
+    const char *save_model_path = NULL, *load_model_path = NULL;
+    struct model_file_t model_file;
 
     int i;
     if ((i = arg_helper("-dim", argc, argv)) > 0)
@@ -773,6 +3356,62 @@ int main(int argc, char **argv)
         threads_n = (int64_t)atoi(argv[i + 1]);
     if ((i = arg_helper("-lr", argc, argv)) > 0)
         lr = (floatx)atof(argv[i + 1]);
+    if ((i = arg_helper("-opt", argc, argv)) > 0)
+        dense_ops = parse_opt(argv[i + 1]);
+    if ((i = arg_helper("-em-opt", argc, argv)) > 0)
+        em_ops = parse_opt(argv[i + 1]);
+    if (em_ops == NULL)
+        em_ops = dense_ops;
+    if ((i = arg_helper("-bf16", argc, argv)) > 0)
+        bf16 = 1;
+    if ((i = arg_helper("-loss-scale", argc, argv)) > 0)
+        loss_scale = (floatx)atof(argv[i + 1]);
+    if ((i = arg_helper("-staleness", argc, argv)) > 0)
+        staleness = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-split-len", argc, argv)) > 0)
+        split_len = (int64_t)atoi(argv[i + 1]);
+    // 同一个seed在任意线程数下训练出的模型逐位相同，-staleness > 0 时除外
+    rng_seed = (uint64_t)time(NULL);
+    if ((i = arg_helper("-seed", argc, argv)) > 0)
+        rng_seed = (uint64_t)strtoull(argv[i + 1], NULL, 10);
+    if ((i = arg_helper("-numa", argc, argv)) > 0)
+    {
+        if (strcmp(argv[i + 1], "interleave") == 0)
+            table_placement = PLACE_INTERLEAVE;
+        else if (strcmp(argv[i + 1], "partition") == 0)
+            table_placement = PLACE_PARTITION;
+        else if (strcmp(argv[i + 1], "first-touch") != 0)
+        {
+            printf("error: unknown -numa %s (first-touch, interleave, partition)\n", argv[i + 1]);
+            exit(-1);
+        }
+    }
+    if ((i = arg_helper("-affinity", argc, argv)) > 0)
+        affinity = argv[i + 1];
+    if ((i = arg_helper("-numa-bench", argc, argv)) > 0)
+    {
+        numa_bench(em_dim, vocab_num > 0 ? vocab_num : 1000000);
+        return 0;
+    }
+    if ((i = arg_helper("-checkpoint", argc, argv)) > 0)
+        checkpoint_path = argv[i + 1];
+    if ((i = arg_helper("-checkpoint-every", argc, argv)) > 0)
+        checkpoint_every = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-checkpoint-full-every", argc, argv)) > 0)
+        checkpoint_full_every = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-compact", argc, argv)) > 0)
+    {
+        compact_checkpoint(argv[i + 1]);
+        return 0;
+    }
+    if ((i = arg_helper("-resume", argc, argv)) > 0)
+        resume_path = argv[i + 1];
+    if ((i = arg_helper("-eval-threads", argc, argv)) > 0)
+        eval_threads = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-eval-batch-size", argc, argv)) > 0)
+        eval_batch_size = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-eval-log", argc, argv)) > 0)
+        eval_log_path = argv[i + 1];
     if ((i = arg_helper("-train", argc, argv)) > 0)
         train_data_path = argv[i + 1];
     if ((i = arg_helper("-vali", argc, argv)) > 0)
@@ -785,6 +3424,27 @@ int main(int argc, char **argv)
         em_len = (int64_t)atoi(argv[i + 1]);
     if ((i = arg_helper("-limit-vocab", argc, argv)) > 0)
         limit_vocab = (floatx)atof(argv[i + 1]);
+    if ((i = arg_helper("-save-model", argc, argv)) > 0)
+        save_model_path = argv[i + 1];
+    if ((i = arg_helper("-load-model", argc, argv)) > 0)
+        load_model_path = argv[i + 1];
+
+    // 维度从模型文件里读，命令行给了就必须一致
+    if (load_model_path != NULL)
+    {
+        map_model(load_model_path, &model, &model_file);
+        if ((arg_helper("-dim", argc, argv) > 0 && em_dim != model.em_dim) || (vocab_num != 0 && vocab_num != model.vocab_num) ||
+            (category_num != 0 && category_num != model.category_num))
+        {
+            printf("error: model %s has dim %ld, vocab %ld, category %ld", load_model_path, model.em_dim, model.vocab_num, model.category_num);
+            exit(-1);
+        }
+        em_dim = model.em_dim;
+        vocab_num = model.vocab_num;
+        category_num = model.category_num;
+        if (arg_helper("-limit-vocab", argc, argv) < 0)
+            limit_vocab = (floatx)model_file.header->max_token / vocab_num;
+    }
 
     if (vocab_num == 0)
     {
@@ -796,13 +3456,54 @@ int main(int argc, char **argv)
         printf("error: miss -category");
         exit(-1);
     }
-    if (train_data_path == NULL)
+    if (train_data_path == NULL && load_model_path == NULL)
     {
         printf("error: need train data!");
         exit(-1);
     }
+    if (staleness < 0)
+    {
+        printf("error: -staleness must be >= 0");
+        exit(-1);
+    }
+    if (split_len < 1)
+    {
+        printf("error: -split-len must be >= 1");
+        exit(-1);
+    }
+    if (eval_batch_size < 1)
+    {
+        printf("error: -eval-batch-size must be >= 1");
+        exit(-1);
+    }
 
-    init_model(&model, em_dim, vocab_num, category_num, 1);
+    // 默认用训练没有绑定的cpu在后台评估，没绑核或者没有空闲的cpu时用四分之一的线程，0: 每个epoch结束时同步评估
+    int64_t free_cpus = pin_threads(affinity, threads_n);
+    if (eval_threads < 0)
+        eval_threads = free_cpus > 0 ? free_cpus : (threads_n / 4 > 1 ? threads_n / 4 : 1);
+    printf("seed: %lu\n", (unsigned long)rng_seed);
+    // 模型和优化器状态都放在一个arena里
+    struct arena_t arena;
+    init_arena(&arena, arena_size(em_dim, vocab_num, category_num, dense_ops, em_ops));
+    table_arena = &arena;
+    if (load_model_path != NULL)
+    {
+        // 训练时模型要在arena里(checkpoint)，从映射拷过去
+        struct model_t loaded = model;
+        init_model(&model, em_dim, vocab_num, category_num, 0);
+        memcpy(model.em, loaded.em, em_dim * vocab_num * sizeof(floatx));
+        memcpy(model.em_bi, loaded.em_bi, em_dim * vocab_num * sizeof(floatx));
+        memcpy(model.w, loaded.w, em_dim * category_num * sizeof(floatx));
+        memcpy(model.w_bi, loaded.w_bi, em_dim * category_num * sizeof(floatx));
+        memcpy(model.b, loaded.b, category_num * sizeof(floatx));
+        if (model_file.vocab_map != NULL)
+            printf("warning: the vocab_map of %s is not used in training\n", load_model_path);
+        unmap_model(&model_file);
+        printf("loaded model from %s\n", load_model_path);
+    }
+    else
+        init_model(&model, em_dim, vocab_num, category_num, 1);
+    report_memory(&model, dense_ops, em_ops);
 
     if (train_data_path != NULL)
         load_data(&train_data, train_data_path, (int64_t)(limit_vocab*vocab_num));
@@ -811,17 +3512,24 @@ int main(int argc, char **argv)
     if (vali_data_path != NULL)
         load_data(&vali_data, vali_data_path, (int64_t)(limit_vocab*vocab_num));
 
-    if (vali_data_path != NULL)
-        train_adam(&model, &train_data, &vali_data, epochs, batch_size, threads_n);
-    else
-        train_adam(&model, &train_data, NULL, epochs, batch_size, threads_n);
+    struct train_config_t cfg = {epochs, batch_size, threads_n, dense_ops, em_ops, lr, bf16, loss_scale, staleness, split_len,
+                                  checkpoint_path, checkpoint_every, checkpoint_full_every, resume_path, eval_threads,
+                                  eval_batch_size};
+    if (train_data_path != NULL)
+        train(&model, &train_data, vali_data_path != NULL ? &vali_data : NULL, &cfg);
 
     if (test_data_path != NULL)
     {
+        struct eval_buffers_t eval_buffers;
         printf("evaluate test data...\n");
-        evaluate(&model, &test_data, batch_size, threads_n);
+        init_eval_buffers(&eval_buffers, em_dim, category_num, eval_batch_size, threads_n);
+        evaluate(&model, &test_data, &eval_buffers, split_len, "test");
+        free_eval_buffers(&eval_buffers);
     }
 
+    if (save_model_path != NULL)
+        save_model(&model, save_model_path, (int64_t)(limit_vocab * vocab_num));
+
     if (em_path != NULL)
     {
         printf("saving em...\n");
@@ -831,6 +3539,8 @@ int main(int argc, char **argv)
     }
 
     free_model(&model);
+    free_arena(&arena);
+    table_arena = NULL;
     if (train_data_path != NULL)
         free_data(&train_data);
     if (test_data_path != NULL)
@@ -0,0 +1,2157 @@
+// inference of fntext_bi models: the library of fntext_infer.h and a command line tool
+// gcc -O3 -march=native -o fntext_infer fntext_infer.c -lm -lpthread (-O3 vectorizes the pooling loops)
+// build only the library: gcc -O3 -march=native -DFNT_INFER_LIB -c fntext_infer.c
+//
+// fntext_infer -model model.bin [-input path] [-scores] [-bench] [-cache entries]
+// fntext_infer -model model.bin -topk 5 [-input path] [-output path] [-binary] [-max-batch 64] [-bench]
+// fntext_infer -model model.bin -serve socket [-max-batch 64] [-max-wait-us 200] [-stats-every 10] [-reload-ms 1000] [-cache entries]
+// fntext_infer -model model.bin -quantize out.bin [-subspaces dim/4] [-centroids 256] [-kmeans-iters 10] [-kmeans-sample 16384] [-input test.txt]
+// fntext_infer -model model.bin -prune out.bin -calib calib.txt [-keep 0.1] [-keep-curve 1,0.5,0.2,0.1] [-input test.txt]
+// fntext_infer -connect socket [-input path] [-window 64] [-scores] [-bench]
+// 每行一个文本: 空格分开的token id，可以带 "category," 前缀(和训练数据一样)，带了就统计准确率
+// 每行输出预测的类别，-scores 同时输出每个类别的logit，-bench 在stderr输出每个文本的延迟分布
+// -topk k: 每max-batch行一起算，每行输出概率最高的k个类别 "label\tprob\tlabel\tprob..."(没有词表里的词: -1)
+// -binary: 输出 "FNTTOPK\0" | int64 k | 每行 int32 labels[k] | float probs[k]，不足k个或没有词表里的词的位置 label = -1, prob = 0
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include "fntext_model.h"
+#include "fntext_infer.h"
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+typedef float floatx;
+
+struct fnt_model
+{
+    char *base;
+    int64_t bytes;
+    int64_t em_dim, vocab_num, category_num, max_token;
+    const floatx *em, *em_bi, *w, *w_bi, *b;
+    const int32_t *vocab_map;
+    // product quantization: em/em_bi are NULL, the row r of a table is the concatenation over the pq_m subspaces
+    // of book[(m * pq_k + code[r * pq_m + m]) * pq_dsub], pq_dsub floats each
+    int64_t pq_m, pq_k, pq_dsub;
+    const uint8_t *em_code, *em_bi_code;
+    const floatx *em_book, *em_bi_book;
+    int64_t id; // different for every loaded model, part of the key of the prediction cache
+};
+
+static int64_t fnt_model_ids = 0;
+
+struct fnt_model *fnt_load(const char *path)
+{
+    int64_t bytes = 0, bad = 0;
+    char *base = model_file_map(path, &bytes);
+    if (base == NULL)
+        return NULL;
+    struct model_header_t *header = (struct model_header_t *)base;
+    if (header->variant != VARIANT_BI)
+    {
+        printf("error: model %s is of variant %s, not bi\n", path, header->variant_name);
+        munmap(base, bytes);
+        return NULL;
+    }
+    struct fnt_model *model = (struct fnt_model *)calloc(1, sizeof(struct fnt_model));
+    int64_t em_dim = header->em_dim, vocab_num = header->vocab_num, category_num = header->category_num;
+    model->base = base;
+    model->bytes = bytes;
+    model->em_dim = em_dim;
+    model->vocab_num = vocab_num;
+    model->category_num = category_num;
+    model->max_token = header->max_token;
+    model->id = __atomic_add_fetch(&fnt_model_ids, 1, __ATOMIC_RELAXED);
+    model->em = (floatx *)model_file_table(base, bytes, "em", vocab_num, em_dim, MODEL_F32, &bad);
+    model->em_bi = (floatx *)model_file_table(base, bytes, "em_bi", vocab_num, em_dim, MODEL_F32, &bad);
+    model->w = (floatx *)model_file_table(base, bytes, "w", category_num, em_dim, MODEL_F32, &bad);
+    model->w_bi = (floatx *)model_file_table(base, bytes, "w_bi", category_num, em_dim, MODEL_F32, &bad);
+    model->b = (floatx *)model_file_table(base, bytes, "b", 1, category_num, MODEL_F32, &bad);
+    model->vocab_map = (int32_t *)model_file_table(base, bytes, "vocab_map", header->max_token, 1, MODEL_I32, &bad);
+    const int32_t *pq = (int32_t *)model_file_table(base, bytes, "pq", 1, 2, MODEL_I32, &bad);
+    if (pq != NULL && pq[0] > 0 && em_dim % pq[0] == 0 && pq[1] > 0 && pq[1] <= 256)
+    {
+        model->pq_m = pq[0];
+        model->pq_k = pq[1];
+        model->pq_dsub = em_dim / pq[0];
+        model->em_book = (floatx *)model_file_table(base, bytes, "em_pq_book", model->pq_m * model->pq_k, model->pq_dsub, MODEL_F32, &bad);
+        model->em_bi_book = (floatx *)model_file_table(base, bytes, "em_bi_pq_book", model->pq_m * model->pq_k, model->pq_dsub, MODEL_F32, &bad);
+        model->em_code = (uint8_t *)model_file_table(base, bytes, "em_pq_code", vocab_num, model->pq_m, MODEL_U8, &bad);
+        model->em_bi_code = (uint8_t *)model_file_table(base, bytes, "em_bi_pq_code", vocab_num, model->pq_m, MODEL_U8, &bad);
+        bad |= model->em_book == NULL || model->em_bi_book == NULL || model->em_code == NULL || model->em_bi_code == NULL;
+    }
+    else if (pq != NULL)
+        bad = 1;
+    if (bad || (pq == NULL && (model->em == NULL || model->em_bi == NULL)) || model->w == NULL || model->w_bi == NULL || model->b == NULL)
+    {
+        printf("error: model %s misses a table\n", path);
+        fnt_free(model);
+        return NULL;
+    }
+    return model;
+}
+
+void fnt_free(struct fnt_model *model)
+{
+    if (model == NULL)
+        return;
+    munmap(model->base, model->bytes);
+    free(model);
+}
+
+int64_t fnt_dim(const struct fnt_model *model)
+{
+    return model->em_dim;
+}
+
+int64_t fnt_category_num(const struct fnt_model *model)
+{
+    return model->category_num;
+}
+
+// em row of token, -1 if the token was not trained (load_data drops it)
+static inline int64_t fnt_row(const struct fnt_model *model, int64_t token)
+{
+    if (token < 0 || token >= model->max_token)
+        return -1;
+    int64_t row = model->vocab_map != NULL ? model->vocab_map[token] : token;
+    return row < model->vocab_num ? row : -1;
+}
+
+// row of em (or em_bi), decoded into buf when the model is quantized
+// 解码就是查表: 每个子空间按code从码本里拷贝pq_dsub个数
+static inline const floatx *fnt_em_row(const struct fnt_model *model, const floatx *em, const uint8_t *code, const floatx *book, int64_t row, floatx *buf)
+{
+    if (em != NULL)
+        return &em[row * model->em_dim];
+    int64_t pq_m = model->pq_m, pq_k = model->pq_k, pq_dsub = model->pq_dsub;
+    const uint8_t *c = &code[row * pq_m];
+    // 常用的子空间维数用常量长度拷贝，一个子空间是一次向量load/store
+    switch (pq_dsub)
+    {
+    case 4:
+        for (int64_t m = 0; m < pq_m; m++)
+            memcpy(&buf[m * 4], &book[(m * pq_k + c[m]) * 4], 4 * sizeof(floatx));
+        break;
+    case 8:
+        for (int64_t m = 0; m < pq_m; m++)
+            memcpy(&buf[m * 8], &book[(m * pq_k + c[m]) * 8], 8 * sizeof(floatx));
+        break;
+    default:
+        for (int64_t m = 0; m < pq_m; m++)
+            memcpy(&buf[m * pq_dsub], &book[(m * pq_k + c[m]) * pq_dsub], pq_dsub * sizeof(floatx));
+    }
+    return buf;
+}
+
+// the same pooling as pool_range in fntext_bi.c, without the argmax indices
+// 被忽略的token不参与bigram，和训练数据里删掉它们一样；只有一个token时bigram是它自己
+// quantized models pool the decoded rows
+int64_t fnt_pool(const struct fnt_model *model, const int64_t *tokens, int64_t len, float *fea)
+{
+    int64_t em_dim = model->em_dim;
+    floatx *restrict max_fea = fea, *restrict max_bi_fea = fea + em_dim;
+    floatx buf[3 * em_dim]; // decoded rows: em | em_bi of two tokens
+    const floatx *prev_bi = NULL;
+    int64_t n = 0;
+
+    for (int64_t i = 0; i < len; i++)
+    {
+        int64_t row = fnt_row(model, tokens[i]);
+        if (row < 0)
+            continue;
+        const floatx *restrict e = fnt_em_row(model, model->em, model->em_code, model->em_book, row, buf);
+        const floatx *e_bi = fnt_em_row(model, model->em_bi, model->em_bi_code, model->em_bi_book, row, &buf[(1 + (n & 1)) * em_dim]);
+        if (n == 0)
+            memcpy(max_fea, e, em_dim * sizeof(floatx));
+        else
+        {
+            for (int64_t j = 0; j < em_dim; j++)
+                max_fea[j] = max_fea[j] > e[j] ? max_fea[j] : e[j];
+        }
+        if (n > 0)
+        {
+            const floatx *restrict e0 = prev_bi, *restrict e1 = e_bi;
+            if (n == 1)
+            {
+                for (int64_t j = 0; j < em_dim; j++)
+                    max_bi_fea[j] = (e0[j] + e1[j]) * 0.5f;
+            }
+            else
+            {
+                for (int64_t j = 0; j < em_dim; j++)
+                {
+                    floatx fea = (e0[j] + e1[j]) * 0.5f;
+                    max_bi_fea[j] = max_bi_fea[j] < fea ? fea : max_bi_fea[j];
+                }
+            }
+        }
+        prev_bi = e_bi;
+        n++;
+    }
+    if (n == 1)
+        memcpy(max_bi_fea, prev_bi, em_dim * sizeof(floatx));
+    return n;
+}
+
+// 按类别在外层循环，一个类别的w/w_bi行在cache里时算完整个batch
+// 每个分数的求和顺序和forward_head一致，预测和evaluate相同
+void fnt_head_batch(const struct fnt_model *model, const float *feas, int64_t n, float *scores, int64_t *labels)
+{
+    int64_t em_dim = model->em_dim, category_num = model->category_num;
+    for (int64_t c = 0; c < category_num; c++)
+    {
+        const floatx *w = &model->w[c * em_dim], *w_bi = &model->w_bi[c * em_dim];
+        for (int64_t d = 0; d < n; d++)
+        {
+            const floatx *max_fea = &feas[2 * d * em_dim], *max_bi_fea = max_fea + em_dim;
+            floatx score = model->b[c];
+            for (int64_t j = 0; j < em_dim; j++)
+                score += (max_fea[j] * w[j] + max_bi_fea[j] * w_bi[j]);
+            scores[d * category_num + c] = score;
+        }
+    }
+    for (int64_t d = 0; d < n; d++)
+    {
+        const floatx *score = &scores[d * category_num];
+        labels[d] = 0;
+        for (int64_t c = 1; c < category_num; c++)
+            if (score[c] > score[labels[d]])
+                labels[d] = c;
+    }
+}
+
+#define TOPK_BLOCK (16) // topk_block_beats 的avx512/avx2路径按16个写的
+
+// insert (c, v) into the descending top[0, n), n < cap or v beats the last one
+static inline int64_t topk_insert(int64_t *labels, floatx *top, int64_t n, int64_t cap, int64_t c, floatx v)
+{
+    int64_t i = n < cap ? n++ : cap - 1;
+    for (; i > 0 && top[i - 1] < v; i--)
+    {
+        top[i] = top[i - 1];
+        labels[i] = labels[i - 1];
+    }
+    top[i] = v;
+    labels[i] = c;
+    return n;
+}
+
+// TOPK_BLOCK个分数里有没有 > last 的: avx512一次比较得到掩码，avx2两次比较+movemask，其它平台逐个比较
+// gcc不会自动向量化这个归约(完全展开成标量比较)，所以显式写
+static inline int topk_block_beats(const float *s, floatx last)
+{
+#if defined(__AVX512F__)
+    return _mm512_cmp_ps_mask(_mm512_loadu_ps(s), _mm512_set1_ps(last), _CMP_GT_OQ) != 0;
+#elif defined(__AVX2__)
+    __m256 t = _mm256_set1_ps(last);
+    __m256 gt = _mm256_or_ps(_mm256_cmp_ps(_mm256_loadu_ps(s), t, _CMP_GT_OQ),
+                             _mm256_cmp_ps(_mm256_loadu_ps(s + 8), t, _CMP_GT_OQ));
+    return _mm256_movemask_ps(gt) != 0;
+#else
+    int beats = 0;
+    for (int64_t j = 0; j < TOPK_BLOCK; j++)
+        beats |= s[j] > last;
+    return beats;
+#endif
+}
+
+// 部分选择: 每TOPK_BLOCK个分数和当前第k个比较，没有超过的整块跳过(见topk_block_beats)
+// k远小于类别数时几乎所有块都被跳过，只有超过门槛的分数才插入
+// 概率只算选中的类别: log-sum-exp的归一化要所有类别的exp之和，但只求一次和
+int64_t fnt_topk(const float *scores, int64_t category_num, int64_t k, int64_t *labels, float *probs)
+{
+    k = k < category_num ? k : category_num;
+    if (k <= 0)
+        return 0;
+    floatx top[k];
+    int64_t n = 0, c = 0;
+
+    for (; c < k; c++)
+        n = topk_insert(labels, top, n, k, c, scores[c]);
+    for (; c + TOPK_BLOCK <= category_num; c += TOPK_BLOCK)
+    {
+        if (!topk_block_beats(&scores[c], top[k - 1]))
+            continue;
+        for (int64_t j = 0; j < TOPK_BLOCK; j++)
+            if (scores[c + j] > top[k - 1])
+                n = topk_insert(labels, top, n, k, c + j, scores[c + j]);
+    }
+    for (; c < category_num; c++)
+        if (scores[c] > top[k - 1])
+            n = topk_insert(labels, top, n, k, c, scores[c]);
+
+    // log(sum(exp(s))) = top[0] + log(sum(exp(s - top[0])))
+    floatx sum = 0.f;
+    for (c = 0; c < category_num; c++)
+        sum += expf(scores[c] - top[0]);
+    floatx lse = top[0] + logf(sum);
+    for (int64_t i = 0; i < k; i++)
+        probs[i] = expf(top[i] - lse);
+    return k;
+}
+
+int64_t fnt_classify(const struct fnt_model *model, const int64_t *tokens, int64_t len, float *out_scores)
+{
+    floatx fea[2 * model->em_dim], scores[model->category_num];
+    int64_t label;
+    if (fnt_pool(model, tokens, len, fea) == 0)
+        return -1;
+    fnt_head_batch(model, fea, 1, out_scores != NULL ? out_scores : scores, &label);
+    return label;
+}
+
+// prediction cache
+// 键是token序列加上模型id，槽里存着token，命中时逐个比较，hash相同的不同文本不会拿到别人的结果
+// hash带一个每个cache随机的种子，外面构造不出落在同一个分片、同一个桶里的文本
+// 每个分片一把锁，分片内: 链式hash表找槽位，CLOCK淘汰(命中时置引用位，指针扫过时清掉引用位，淘汰没有引用位的槽)
+#define CACHE_SHARDS (64)
+
+struct cache_slot_t
+{
+    uint64_t hash;
+    int64_t *tokens, len;
+    int64_t model_id, label;
+    int32_t next; // next slot in the bucket, -1: end
+    uint8_t ref;
+};
+
+struct cache_shard_t
+{
+    pthread_mutex_t lock;
+    int64_t cap, buckets_n, hand, used_n;
+    int32_t *buckets;
+    struct cache_slot_t *slots;
+    floatx *scores; // cap * category_num
+    int64_t hits, misses, insertions, evictions;
+    char pad[64];
+};
+
+struct fnt_cache
+{
+    int64_t category_num;
+    uint64_t seed;
+    struct cache_shard_t shards[CACHE_SHARDS];
+};
+
+static inline uint64_t fnt_mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// hash of tokens[0, len) keyed by seed
+static uint64_t fnt_hash_tokens(uint64_t seed, const int64_t *tokens, int64_t len)
+{
+    uint64_t h = fnt_mix64(seed ^ (uint64_t)len);
+    for (int64_t i = 0; i < len; i++)
+    {
+        h = (h ^ (seed + (uint64_t)tokens[i])) * 0x9fb21c651e98df25ull;
+        h ^= h >> 29;
+    }
+    return fnt_mix64(h ^ seed);
+}
+
+struct fnt_cache *fnt_cache_new(int64_t capacity, int64_t category_num)
+{
+    // aligned_alloc的大小必须是对齐的整数倍
+    struct fnt_cache *cache = (struct fnt_cache *)aligned_alloc(64, (sizeof(struct fnt_cache) + 63) / 64 * 64);
+    int64_t cap = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    cap = cap > 1 ? cap : 1;
+    memset(cache, 0, sizeof(*cache));
+    cache->category_num = category_num;
+    if (getrandom(&cache->seed, sizeof(cache->seed), 0) != sizeof(cache->seed))
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        cache->seed = fnt_mix64((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec) ^ (uint64_t)(uintptr_t)cache;
+    }
+    for (int64_t k = 0; k < CACHE_SHARDS; k++)
+    {
+        struct cache_shard_t *shard = &cache->shards[k];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->cap = cap;
+        for (shard->buckets_n = 1; shard->buckets_n < cap; shard->buckets_n *= 2)
+            ;
+        shard->buckets = (int32_t *)malloc(shard->buckets_n * sizeof(int32_t));
+        memset(shard->buckets, 0xff, shard->buckets_n * sizeof(int32_t));
+        shard->slots = (struct cache_slot_t *)calloc(cap, sizeof(struct cache_slot_t));
+        shard->scores = (floatx *)malloc(cap * category_num * sizeof(floatx));
+    }
+    return cache;
+}
+
+void fnt_cache_free(struct fnt_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    for (int64_t k = 0; k < CACHE_SHARDS; k++)
+    {
+        pthread_mutex_destroy(&cache->shards[k].lock);
+        for (int64_t i = 0; i < cache->shards[k].used_n; i++)
+            free(cache->shards[k].slots[i].tokens);
+        free(cache->shards[k].buckets);
+        free(cache->shards[k].slots);
+        free(cache->shards[k].scores);
+    }
+    free(cache);
+}
+
+// the slot of the key in shard, -1 if there is none, the shard must be locked
+static int64_t cache_find(struct cache_shard_t *shard, uint64_t hash, const int64_t *tokens, int64_t len, int64_t model_id)
+{
+    for (int32_t i = shard->buckets[hash & (shard->buckets_n - 1)]; i >= 0; i = shard->slots[i].next)
+    {
+        struct cache_slot_t *slot = &shard->slots[i];
+        if (slot->hash == hash && slot->len == len && slot->model_id == model_id && memcmp(slot->tokens, tokens, len * sizeof(int64_t)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int64_t fnt_cache_get(struct fnt_cache *cache, const struct fnt_model *model, const int64_t *tokens, int64_t len, int64_t *label, float *scores)
+{
+    uint64_t hash = fnt_hash_tokens(cache->seed, tokens, len);
+    struct cache_shard_t *shard = &cache->shards[(hash >> 58) % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    int64_t i = cache_find(shard, hash, tokens, len, model->id);
+    if (i >= 0)
+    {
+        shard->slots[i].ref = 1;
+        *label = shard->slots[i].label;
+        if (scores != NULL)
+            memcpy(scores, &shard->scores[i * cache->category_num], cache->category_num * sizeof(floatx));
+        shard->hits++;
+    }
+    else
+        shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return i >= 0;
+}
+
+void fnt_cache_put(struct fnt_cache *cache, const struct fnt_model *model, const int64_t *tokens, int64_t len, int64_t label, const float *scores)
+{
+    uint64_t hash = fnt_hash_tokens(cache->seed, tokens, len);
+    int64_t *copy = (int64_t *)malloc(len * sizeof(int64_t) + 1); // + 1: 空文本也不是NULL
+    memcpy(copy, tokens, len * sizeof(int64_t));
+    struct cache_shard_t *shard = &cache->shards[(hash >> 58) % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    // 另一个线程可能已经放进去了
+    if (cache_find(shard, hash, tokens, len, model->id) >= 0)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        free(copy);
+        return;
+    }
+    int64_t i;
+    if (shard->used_n < shard->cap)
+        i = shard->used_n++;
+    else
+    {
+        // CLOCK: 最多转两圈就能找到没有引用位的槽
+        while (shard->slots[shard->hand].ref)
+        {
+            shard->slots[shard->hand].ref = 0;
+            shard->hand = (shard->hand + 1) % shard->cap;
+        }
+        i = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->cap;
+        int32_t *p = &shard->buckets[shard->slots[i].hash & (shard->buckets_n - 1)];
+        while (*p != i)
+            p = &shard->slots[*p].next;
+        *p = shard->slots[i].next;
+        free(shard->slots[i].tokens);
+        shard->evictions++;
+    }
+    struct cache_slot_t *slot = &shard->slots[i];
+    int32_t *bucket = &shard->buckets[hash & (shard->buckets_n - 1)];
+    slot->hash = hash;
+    slot->tokens = copy;
+    slot->len = len;
+    slot->model_id = model->id;
+    slot->label = label;
+    slot->ref = 0;
+    slot->next = *bucket;
+    *bucket = (int32_t)i;
+    memcpy(&shard->scores[i * cache->category_num], scores, cache->category_num * sizeof(floatx));
+    shard->insertions++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void fnt_cache_stats(struct fnt_cache *cache, struct fnt_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int64_t k = 0; k < CACHE_SHARDS; k++)
+    {
+        struct cache_shard_t *shard = &cache->shards[k];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->insertions += shard->insertions;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->used_n;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int64_t fnt_classify_cached(const struct fnt_model *model, struct fnt_cache *cache, const int64_t *tokens, int64_t len, float *out_scores)
+{
+    floatx scores[model->category_num];
+    int64_t label;
+    if (cache != NULL && fnt_cache_get(cache, model, tokens, len, &label, out_scores))
+        return label;
+    label = fnt_classify(model, tokens, len, scores);
+    if (label >= 0 && cache != NULL)
+        fnt_cache_put(cache, model, tokens, len, label, scores);
+    if (label >= 0 && out_scores != NULL)
+        memcpy(out_scores, scores, model->category_num * sizeof(floatx));
+    return label;
+}
+
+// hot reload
+// 类似SRCU: 读者在当前epoch的计数器上加一再读模型指针，用完减一
+// 换模型时先原子地换指针，再两次翻转epoch，每次等旧epoch的计数器归零，之后没有读者还拿着旧模型，可以unmap
+// 读者从不等待；只有watcher线程等，换模型很少发生
+struct fnt_live
+{
+    char path[4096];
+    int64_t interval_ms;
+    struct fnt_model *current;
+    int64_t epoch;
+    struct
+    {
+        int64_t n;
+        char pad[64 - sizeof(int64_t)];
+    } readers[2];
+    int64_t version;
+    // file the current model was loaded from
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int64_t stop;
+};
+
+struct fnt_model *fnt_live_acquire(struct fnt_live *live, int64_t *ticket)
+{
+    *ticket = __atomic_load_n(&live->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&live->readers[*ticket].n, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&live->current, __ATOMIC_SEQ_CST);
+}
+
+void fnt_live_release(struct fnt_live *live, int64_t ticket)
+{
+    __atomic_sub_fetch(&live->readers[ticket].n, 1, __ATOMIC_RELEASE);
+}
+
+int64_t fnt_live_version(struct fnt_live *live)
+{
+    return __atomic_load_n(&live->version, __ATOMIC_ACQUIRE);
+}
+
+// wait until no reader can still hold a model that was current before the last swap
+static void fnt_live_synchronize(struct fnt_live *live)
+{
+    for (int64_t flip = 0; flip < 2; flip++)
+    {
+        int64_t old = __atomic_fetch_add(&live->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&live->readers[old].n, __ATOMIC_ACQUIRE) != 0)
+        {
+            struct timespec ts = {0, 100000};
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+// 1 if the file at path is not the one the current model was loaded from
+static int64_t fnt_live_changed(struct fnt_live *live, struct stat *st)
+{
+    if (stat(live->path, st) != 0)
+        return 0;
+    return st->st_dev != live->dev || st->st_ino != live->ino || st->st_size != live->size || st->st_mtim.tv_sec != live->mtime.tv_sec ||
+           st->st_mtim.tv_nsec != live->mtime.tv_nsec;
+}
+
+static void fnt_live_remember(struct fnt_live *live, struct stat *st)
+{
+    live->dev = st->st_dev;
+    live->ino = st->st_ino;
+    live->size = st->st_size;
+    live->mtime = st->st_mtim;
+}
+
+static void *fnt_live_watch(void *arg)
+{
+    struct fnt_live *live = (struct fnt_live *)arg;
+    struct stat st;
+    pthread_mutex_lock(&live->lock);
+    while (!live->stop)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        int64_t ns = ts.tv_nsec + live->interval_ms * 1000000;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&live->cond, &live->lock, &ts);
+        if (live->stop || !fnt_live_changed(live, &st))
+            continue;
+        pthread_mutex_unlock(&live->lock);
+
+        // 文件不完整或者类别数不同时保留当前模型，文件再变时重试
+        struct fnt_model *model = fnt_load(live->path), *old = live->current;
+        fnt_live_remember(live, &st);
+        if (model != NULL && model->category_num != old->category_num)
+        {
+            fprintf(stderr, "error: %s has %ld categories instead of %ld, keep the current model\n", live->path, model->category_num, old->category_num);
+            fnt_free(model);
+            model = NULL;
+        }
+        if (model != NULL)
+        {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            __atomic_store_n(&live->current, model, __ATOMIC_SEQ_CST);
+            int64_t version = __atomic_add_fetch(&live->version, 1, __ATOMIC_RELEASE);
+            fnt_live_synchronize(live);
+            fnt_free(old);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            fprintf(stderr, "reloaded %s: version %ld, dim %ld, vocab %ld, old model freed after %.2fms\n", live->path, version, model->em_dim,
+                    model->vocab_num, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6);
+        }
+        pthread_mutex_lock(&live->lock);
+    }
+    pthread_mutex_unlock(&live->lock);
+    return NULL;
+}
+
+struct fnt_live *fnt_live_open(const char *path, int64_t interval_ms)
+{
+    struct stat st;
+    struct fnt_live *live;
+    if (strlen(path) >= sizeof(live->path) || stat(path, &st) != 0)
+    {
+        printf("error: can not open model %s\n", path);
+        return NULL;
+    }
+    live = (struct fnt_live *)calloc(1, sizeof(struct fnt_live));
+    strcpy(live->path, path);
+    live->interval_ms = interval_ms;
+    fnt_live_remember(live, &st);
+    if ((live->current = fnt_load(path)) == NULL)
+    {
+        free(live);
+        return NULL;
+    }
+    live->version = 1;
+    if (interval_ms > 0)
+    {
+        pthread_condattr_t attr;
+        pthread_mutex_init(&live->lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&live->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_create(&live->thread, NULL, fnt_live_watch, live);
+    }
+    return live;
+}
+
+void fnt_live_close(struct fnt_live *live)
+{
+    if (live == NULL)
+        return;
+    if (live->interval_ms > 0)
+    {
+        pthread_mutex_lock(&live->lock);
+        live->stop = 1;
+        pthread_cond_signal(&live->cond);
+        pthread_mutex_unlock(&live->lock);
+        pthread_join(live->thread, NULL);
+        pthread_mutex_destroy(&live->lock);
+        pthread_cond_destroy(&live->cond);
+    }
+    fnt_free(live->current);
+    free(live);
+}
+
+#ifndef FNT_INFER_LIB
+
+int arg_helper(char *str, int argc, char **argv)
+{
+    int pos;
+    for (pos = 1; pos < argc; pos++)
+        if (strcmp(str, argv[pos]) == 0)
+            return pos;
+    return -1;
+}
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// parse "[category,] token token ..." into *tokens, returns the category or -1
+int64_t parse_line(const char *line, int64_t **tokens, int64_t *cap, int64_t *len)
+{
+    int64_t label = -1;
+    const char *p = line, *comma = strchr(line, ',');
+    char *end;
+    if (comma != NULL)
+    {
+        label = strtoll(line, NULL, 10);
+        p = comma + 1;
+    }
+    *len = 0;
+    for (;;)
+    {
+        int64_t token = strtoll(p, &end, 10);
+        if (end == p)
+            break;
+        if (*len == *cap)
+        {
+            *cap *= 2;
+            *tokens = (int64_t *)realloc(*tokens, *cap * sizeof(int64_t));
+        }
+        (*tokens)[(*len)++] = token;
+        p = end;
+    }
+    return label;
+}
+
+void print_prediction(int64_t pred, const float *scores, int64_t category_num, int64_t show_scores)
+{
+    printf("%ld", pred);
+    if (show_scores && pred >= 0)
+    {
+        for (int64_t c = 0; c < category_num; c++)
+            printf("%c%.6g", c == 0 ? '\t' : ' ', scores[c]);
+    }
+    printf("\n");
+}
+
+void print_latency(const char *name, double *lats, int64_t n)
+{
+    if (n == 0)
+        return;
+    qsort(lats, n, sizeof(double), cmp_double);
+    fprintf(stderr, "latency (us, %s): p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n", name, lats[n / 2], lats[n * 9 / 10], lats[n * 99 / 100], lats[n - 1]);
+}
+
+void print_cache_stats(struct fnt_cache *cache)
+{
+    struct fnt_cache_stats stats;
+    fnt_cache_stats(cache, &stats);
+    int64_t lookups = stats.hits + stats.misses;
+    fprintf(stderr, "  cache: hit rate %.2f%% (%ld of %ld), %ld entries, %ld insertions, %ld evictions\n", lookups > 0 ? 100. * stats.hits / lookups : 0.,
+            stats.hits, lookups, stats.entries, stats.insertions, stats.evictions);
+}
+
+// classify the lines of fp one by one, through the cache if it is not NULL
+void classify_stream(struct fnt_model *model, struct fnt_cache *cache, FILE *fp, int64_t show_scores, int64_t bench)
+{
+    int64_t category_num = fnt_category_num(model);
+    float *scores = (float *)malloc(category_num * sizeof(float));
+    int64_t tokens_cap = 1024, docs_n = 0, labeled_n = 0, correct_n = 0, len;
+    int64_t *tokens = (int64_t *)malloc(tokens_cap * sizeof(int64_t));
+    int64_t lat_cap = 1024;
+    double *lats = bench ? (double *)malloc(lat_cap * sizeof(double)) : NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    while (getline(&line, &line_cap, fp) > 0)
+    {
+        int64_t label = parse_line(line, &tokens, &tokens_cap, &len);
+        double start = bench ? now_seconds() : 0.;
+        int64_t pred = fnt_classify_cached(model, cache, tokens, len, scores);
+        if (bench)
+        {
+            if (docs_n == lat_cap)
+            {
+                lat_cap *= 2;
+                lats = (double *)realloc(lats, lat_cap * sizeof(double));
+            }
+            lats[docs_n] = (now_seconds() - start) * 1e6;
+        }
+        docs_n++;
+        if (label >= 0)
+        {
+            labeled_n++;
+            correct_n += pred == label;
+        }
+        print_prediction(pred, scores, category_num, show_scores);
+    }
+
+    if (labeled_n > 0)
+        fprintf(stderr, "#docs: %ld, precision: %.5f\n", docs_n, (double)correct_n / labeled_n);
+    if (bench)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "dim %ld", fnt_dim(model));
+        print_latency(name, lats, docs_n);
+    }
+    if (cache != NULL)
+        print_cache_stats(cache);
+    free(line);
+    free(tokens);
+    free(scores);
+    free(lats);
+}
+
+// write v in decimal at p, returns the end
+static char *put_int(char *p, int64_t v)
+{
+    char digits[24];
+    int64_t n = 0;
+    if (v < 0)
+    {
+        *p++ = '-';
+        v = -v;
+    }
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+// write a probability in [0, 1] with 6 decimals at p, returns the end
+static char *put_prob(char *p, float prob)
+{
+    int64_t v = (int64_t)(prob * 1e6f + 0.5f);
+    v = v < 0 ? 0 : (v > 1000000 ? 1000000 : v);
+    *p++ = '0' + v / 1000000;
+    *p++ = '.';
+    for (int64_t d = 100000; d > 0; d /= 10)
+        *p++ = '0' + v / d % 10;
+    return p;
+}
+
+// top k of the lines of fp into out, max_batch lines at a time
+// 每个batch: 逐行pooling，fnt_head_batch一起算logits，fnt_topk，结果写进一个buffer后一次fwrite
+void classify_topk(struct fnt_model *model, FILE *fp, FILE *out, int64_t k, int64_t binary, int64_t max_batch, int64_t bench)
+{
+    int64_t em_dim = fnt_dim(model), category_num = fnt_category_num(model);
+    int64_t tokens_cap = 1024, docs_n = 0, labeled_n = 0, correct_n = 0, len, eof = 0;
+    int64_t *tokens = (int64_t *)malloc(tokens_cap * sizeof(int64_t));
+    float *feas = (float *)malloc(2 * em_dim * max_batch * sizeof(float));
+    float *scores = (float *)malloc(category_num * max_batch * sizeof(float));
+    int64_t *pooled = (int64_t *)malloc(max_batch * sizeof(int64_t)); // 每行在feas里的位置，-1: 没有词表里的词
+    int64_t *labels = (int64_t *)malloc(max_batch * sizeof(int64_t));
+    int64_t *preds = (int64_t *)malloc(max_batch * sizeof(int64_t));
+    int64_t *top = (int64_t *)malloc(k * sizeof(int64_t));
+    float *probs = (float *)malloc(k * sizeof(float));
+    int64_t row_bytes = binary ? k * (int64_t)(sizeof(int32_t) + sizeof(float)) : k * 32 + 1;
+    char *buf = (char *)malloc(max_batch * row_bytes);
+    char *line = NULL;
+    size_t line_cap = 0;
+    double start = now_seconds();
+
+    if (binary)
+    {
+        char magic[8] = "FNTTOPK";
+        fwrite(magic, sizeof(magic), 1, out);
+        fwrite(&k, sizeof(k), 1, out);
+    }
+    while (!eof)
+    {
+        int64_t n = 0, pooled_n = 0;
+        while (n < max_batch)
+        {
+            if (getline(&line, &line_cap, fp) <= 0)
+            {
+                eof = 1;
+                break;
+            }
+            labels[n] = parse_line(line, &tokens, &tokens_cap, &len);
+            pooled[n] = fnt_pool(model, tokens, len, &feas[2 * pooled_n * em_dim]) > 0 ? pooled_n++ : -1;
+            n++;
+        }
+        if (pooled_n > 0)
+            fnt_head_batch(model, feas, pooled_n, scores, preds);
+
+        char *p = buf;
+        for (int64_t d = 0; d < n; d++)
+        {
+            int64_t got = pooled[d] < 0 ? 0 : fnt_topk(&scores[pooled[d] * category_num], category_num, k, top, probs);
+            if (labels[d] >= 0)
+            {
+                labeled_n++;
+                correct_n += got > 0 && top[0] == labels[d];
+            }
+            if (binary)
+            {
+                int32_t *row_labels = (int32_t *)p;
+                float *row_probs = (float *)(p + k * sizeof(int32_t));
+                for (int64_t i = 0; i < k; i++)
+                {
+                    row_labels[i] = i < got ? (int32_t)top[i] : -1;
+                    row_probs[i] = i < got ? probs[i] : 0.f;
+                }
+                p += row_bytes;
+                continue;
+            }
+            if (got == 0)
+                p = put_int(p, -1);
+            for (int64_t i = 0; i < got; i++)
+            {
+                if (i > 0)
+                    *p++ = '\t';
+                p = put_int(p, top[i]);
+                *p++ = '\t';
+                p = put_prob(p, probs[i]);
+            }
+            *p++ = '\n';
+        }
+        fwrite(buf, 1, p - buf, out);
+        docs_n += n;
+    }
+
+    if (labeled_n > 0)
+        fprintf(stderr, "#docs: %ld, precision: %.5f\n", docs_n, (double)correct_n / labeled_n);
+    if (bench)
+        fprintf(stderr, "top %ld: %.0f docs/s\n", k, docs_n / (now_seconds() - start));
+    free(line);
+    free(tokens);
+    free(feas);
+    free(scores);
+    free(pooled);
+    free(labels);
+    free(preds);
+    free(top);
+    free(probs);
+    free(buf);
+}
+
+// product quantization
+// 每张表的每个子空间单独用k-means训练pq_k个中心(在最多sample_n行的样本上)，然后把所有行编码成最近的中心
+// 行按固定步长取样，结果是确定的
+
+// nearest of the k centroids to x, centroids_t is transposed (dsub x k) so that the distances to all centroids are computed together
+static int64_t pq_nearest(const floatx *x, const floatx *restrict centroids_t, int64_t k, int64_t dsub, floatx *restrict dist)
+{
+    int64_t best = 0;
+    for (int64_t c = 0; c < k; c++)
+        dist[c] = 0.f;
+    for (int64_t j = 0; j < dsub; j++)
+    {
+        floatx xj = x[j];
+        for (int64_t c = 0; c < k; c++)
+            dist[c] += (xj - centroids_t[j * k + c]) * (xj - centroids_t[j * k + c]);
+    }
+    for (int64_t c = 1; c < k; c++)
+        if (dist[c] < dist[best])
+            best = c;
+    return best;
+}
+
+static void pq_transpose(const floatx *centroids, int64_t k, int64_t dsub, floatx *centroids_t)
+{
+    for (int64_t c = 0; c < k; c++)
+        for (int64_t j = 0; j < dsub; j++)
+            centroids_t[j * k + c] = centroids[c * dsub + j];
+}
+
+// quantize the rows x em_dim table em into book (pq_m * pq_k x dsub) and code (rows x pq_m)
+// returns the squared error of the reconstruction relative to the squared norm of the table
+double pq_quantize(const floatx *em, int64_t rows, int64_t em_dim, int64_t pq_m, int64_t pq_k, int64_t iters, int64_t sample_n, floatx *book, uint8_t *code)
+{
+    int64_t dsub = em_dim / pq_m;
+    sample_n = sample_n < rows ? sample_n : rows;
+    floatx *sample = (floatx *)malloc(sample_n * dsub * sizeof(floatx));
+    floatx *sums = (floatx *)malloc(pq_k * dsub * sizeof(floatx));
+    int64_t *counts = (int64_t *)malloc(pq_k * sizeof(int64_t));
+    floatx *centroids_t = (floatx *)malloc(pq_k * dsub * sizeof(floatx));
+    floatx *dist = (floatx *)malloc(pq_k * sizeof(floatx));
+    double err = 0., norm = 0.;
+
+    for (int64_t m = 0; m < pq_m; m++)
+    {
+        floatx *centroids = &book[m * pq_k * dsub];
+        for (int64_t i = 0; i < sample_n; i++)
+            memcpy(&sample[i * dsub], &em[(i * rows / sample_n) * em_dim + m * dsub], dsub * sizeof(floatx));
+        // 样本比中心少时多余的中心重复
+        for (int64_t c = 0; c < pq_k; c++)
+            memcpy(&centroids[c * dsub], &sample[(c * sample_n / pq_k) * dsub], dsub * sizeof(floatx));
+        for (int64_t it = 0; it < iters; it++)
+        {
+            memset(sums, 0, pq_k * dsub * sizeof(floatx));
+            memset(counts, 0, pq_k * sizeof(int64_t));
+            pq_transpose(centroids, pq_k, dsub, centroids_t);
+            for (int64_t i = 0; i < sample_n; i++)
+            {
+                int64_t c = pq_nearest(&sample[i * dsub], centroids_t, pq_k, dsub, dist);
+                counts[c]++;
+                for (int64_t j = 0; j < dsub; j++)
+                    sums[c * dsub + j] += sample[i * dsub + j];
+            }
+            // 空的中心保持不变
+            for (int64_t c = 0; c < pq_k; c++)
+                for (int64_t j = 0; counts[c] > 0 && j < dsub; j++)
+                    centroids[c * dsub + j] = sums[c * dsub + j] / counts[c];
+        }
+        pq_transpose(centroids, pq_k, dsub, centroids_t);
+        for (int64_t r = 0; r < rows; r++)
+        {
+            const floatx *x = &em[r * em_dim + m * dsub];
+            int64_t c = pq_nearest(x, centroids_t, pq_k, dsub, dist);
+            code[r * pq_m + m] = (uint8_t)c;
+            for (int64_t j = 0; j < dsub; j++)
+            {
+                err += (x[j] - centroids[c * dsub + j]) * (x[j] - centroids[c * dsub + j]);
+                norm += x[j] * x[j];
+            }
+        }
+    }
+    free(sample);
+    free(sums);
+    free(counts);
+    free(centroids_t);
+    free(dist);
+    return norm > 0. ? err / norm : 0.;
+}
+
+// the lines of a labeled text file, kept in memory to compare models on the same input
+struct docs_t
+{
+    int64_t n, tokens_n;
+    int64_t *labels, *starts, *lens, *tokens;
+};
+
+void load_docs(struct docs_t *docs, FILE *fp)
+{
+    int64_t cap = 1024, tokens_cap = 1 << 16, line_tokens_cap = 1024, len;
+    int64_t *line_tokens = (int64_t *)malloc(line_tokens_cap * sizeof(int64_t));
+    char *line = NULL;
+    size_t line_cap = 0;
+    memset(docs, 0, sizeof(*docs));
+    docs->labels = (int64_t *)malloc(cap * sizeof(int64_t));
+    docs->starts = (int64_t *)malloc(cap * sizeof(int64_t));
+    docs->lens = (int64_t *)malloc(cap * sizeof(int64_t));
+    docs->tokens = (int64_t *)malloc(tokens_cap * sizeof(int64_t));
+    while (getline(&line, &line_cap, fp) > 0)
+    {
+        if (docs->n == cap)
+        {
+            cap *= 2;
+            docs->labels = (int64_t *)realloc(docs->labels, cap * sizeof(int64_t));
+            docs->starts = (int64_t *)realloc(docs->starts, cap * sizeof(int64_t));
+            docs->lens = (int64_t *)realloc(docs->lens, cap * sizeof(int64_t));
+        }
+        docs->labels[docs->n] = parse_line(line, &line_tokens, &line_tokens_cap, &len);
+        while (docs->tokens_n + len > tokens_cap)
+        {
+            tokens_cap *= 2;
+            docs->tokens = (int64_t *)realloc(docs->tokens, tokens_cap * sizeof(int64_t));
+        }
+        memcpy(&docs->tokens[docs->tokens_n], line_tokens, len * sizeof(int64_t));
+        docs->starts[docs->n] = docs->tokens_n;
+        docs->lens[docs->n] = len;
+        docs->tokens_n += len;
+        docs->n++;
+    }
+    free(line);
+    free(line_tokens);
+}
+
+void free_docs(struct docs_t *docs)
+{
+    free(docs->labels);
+    free(docs->starts);
+    free(docs->lens);
+    free(docs->tokens);
+}
+
+// classify every doc, print the precision and the latency of one text
+// preds: the predictions, compared with agree_with if it is not NULL
+void report_model(const char *name, struct fnt_model *model, struct docs_t *docs, int64_t *preds, const int64_t *agree_with)
+{
+    int64_t labeled_n = 0, correct_n = 0, agree_n = 0;
+    double *lats = (double *)malloc((docs->n > 0 ? docs->n : 1) * sizeof(double));
+    for (int64_t d = 0; d < docs->n; d++)
+    {
+        double start = now_seconds();
+        preds[d] = fnt_classify(model, &docs->tokens[docs->starts[d]], docs->lens[d], NULL);
+        lats[d] = (now_seconds() - start) * 1e6;
+        if (docs->labels[d] >= 0)
+        {
+            labeled_n++;
+            correct_n += preds[d] == docs->labels[d];
+        }
+        agree_n += agree_with != NULL && preds[d] == agree_with[d];
+    }
+    fprintf(stderr, "%s: %.1f MB", name, model->bytes / 1048576.);
+    if (labeled_n > 0)
+        fprintf(stderr, ", precision %.5f", (double)correct_n / labeled_n);
+    if (agree_with != NULL && docs->n > 0)
+        fprintf(stderr, ", same prediction %.2f%%", 100. * agree_n / docs->n);
+    fprintf(stderr, "\n");
+    print_latency(name, lats, docs->n);
+    free(lats);
+}
+
+// write the product quantized model, then compare it with the original one on docs
+void quantize_model(struct fnt_model *model, const char *path, int64_t pq_m, int64_t pq_k, int64_t iters, int64_t sample_n,
+                    struct docs_t *docs)
+{
+    int64_t em_dim = model->em_dim, vocab_num = model->vocab_num, category_num = model->category_num, dsub = em_dim / pq_m;
+    struct model_header_t header;
+    int32_t pq[2] = {(int32_t)pq_m, (int32_t)pq_k};
+    floatx *books = (floatx *)malloc(2 * pq_m * pq_k * dsub * sizeof(floatx));
+    uint8_t *codes = (uint8_t *)malloc(2 * vocab_num * pq_m);
+    double start = now_seconds();
+
+    double err = pq_quantize(model->em, vocab_num, em_dim, pq_m, pq_k, iters, sample_n, books, codes);
+    double err_bi = pq_quantize(model->em_bi, vocab_num, em_dim, pq_m, pq_k, iters, sample_n, &books[pq_m * pq_k * dsub], &codes[vocab_num * pq_m]);
+    fprintf(stderr, "quantized em, em_bi into %ld subspaces x %ld centroids in %.1fs, relative squared error %.4f, %.4f\n", pq_m, pq_k,
+            now_seconds() - start, err, err_bi);
+
+    const void *data[MODEL_MAX_TABLES] = {pq, books, codes, &books[pq_m * pq_k * dsub], &codes[vocab_num * pq_m], model->w, model->w_bi, model->b,
+                                          model->vocab_map};
+    model_init_header(&header, VARIANT_BI, "bi", em_dim, vocab_num, category_num, model->max_token);
+    model_add_table(&header, "pq", 1, 2, MODEL_I32);
+    model_add_table(&header, "em_pq_book", pq_m * pq_k, dsub, MODEL_F32);
+    model_add_table(&header, "em_pq_code", vocab_num, pq_m, MODEL_U8);
+    model_add_table(&header, "em_bi_pq_book", pq_m * pq_k, dsub, MODEL_F32);
+    model_add_table(&header, "em_bi_pq_code", vocab_num, pq_m, MODEL_U8);
+    model_add_table(&header, "w", category_num, em_dim, MODEL_F32);
+    model_add_table(&header, "w_bi", category_num, em_dim, MODEL_F32);
+    model_add_table(&header, "b", 1, category_num, MODEL_F32);
+    if (model->vocab_map != NULL)
+        model_add_table(&header, "vocab_map", model->max_token, 1, MODEL_I32);
+    if (!model_file_write(path, &header, data))
+    {
+        printf("error: can not write model %s\n", path);
+        exit(-1);
+    }
+    free(books);
+    free(codes);
+
+    struct fnt_model *quantized = fnt_load(path);
+    if (quantized == NULL)
+        exit(-1);
+    int64_t *preds = (int64_t *)malloc((docs->n > 0 ? docs->n : 1) * sizeof(int64_t));
+    int64_t *quantized_preds = (int64_t *)malloc((docs->n > 0 ? docs->n : 1) * sizeof(int64_t));
+    report_model("original", model, docs, preds, NULL);
+    report_model("quantized", quantized, docs, quantized_preds, preds);
+    free(preds);
+    free(quantized_preds);
+    fnt_free(quantized);
+}
+
+// pruning
+// 在校准数据上统计每一行(em和em_bi的同一行)赢得max pooling的维数，只保留赢得最多的行
+// 删掉的token都映射到一个共享的OOV行: 删掉的行的逐维最小值，所以OOV行只在原来删掉的行赢的维上改变pooling的结果
+
+// pool like fnt_pool and add the rows that won each dimension to wins, the two rows of a winning bigram both count
+static void count_wins(const struct fnt_model *model, const int64_t *tokens, int64_t len, int64_t *wins)
+{
+    int64_t em_dim = model->em_dim;
+    floatx max_fea[em_dim], max_bi_fea[em_dim];
+    int64_t win[em_dim], bi_win0[em_dim], bi_win1[em_dim];
+    int64_t n = 0, prev = -1;
+
+    for (int64_t i = 0; i < len; i++)
+    {
+        int64_t row = fnt_row(model, tokens[i]);
+        if (row < 0)
+            continue;
+        const floatx *e = &model->em[row * em_dim];
+        for (int64_t j = 0; j < em_dim; j++)
+        {
+            if (n == 0 || e[j] >= max_fea[j])
+            {
+                max_fea[j] = e[j];
+                win[j] = row;
+            }
+        }
+        if (n > 0)
+        {
+            const floatx *e0 = &model->em_bi[prev * em_dim], *e1 = &model->em_bi[row * em_dim];
+            for (int64_t j = 0; j < em_dim; j++)
+            {
+                floatx fea = (e0[j] + e1[j]) * 0.5f;
+                if (n == 1 || max_bi_fea[j] < fea)
+                {
+                    max_bi_fea[j] = fea;
+                    bi_win0[j] = prev;
+                    bi_win1[j] = row;
+                }
+            }
+        }
+        prev = row;
+        n++;
+    }
+    if (n == 0)
+        return;
+    for (int64_t j = 0; j < em_dim; j++)
+    {
+        wins[win[j]]++;
+        if (n == 1)
+            wins[prev]++;
+        else
+        {
+            wins[bi_win0[j]]++;
+            wins[bi_win1[j]]++;
+        }
+    }
+}
+
+// rows ranked by the wins, ties to the lower row
+static const int64_t *rank_wins;
+int cmp_rank(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    if (rank_wins[x] != rank_wins[y])
+        return rank_wins[x] > rank_wins[y] ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+// a model with the kept_n best rows of ranked and one OOV row, the tables are allocated, w, w_bi and b are shared with model
+void prune_rows(const struct fnt_model *model, const int64_t *ranked, int64_t kept_n, struct fnt_model *pruned)
+{
+    int64_t em_dim = model->em_dim, vocab_num = model->vocab_num;
+    int64_t *new_row = (int64_t *)malloc(vocab_num * sizeof(int64_t));
+    floatx *em = (floatx *)malloc((kept_n + 1) * em_dim * sizeof(floatx));
+    floatx *em_bi = (floatx *)malloc((kept_n + 1) * em_dim * sizeof(floatx));
+    int32_t *vocab_map = (int32_t *)malloc(model->max_token * sizeof(int32_t));
+    floatx *oov = &em[kept_n * em_dim], *oov_bi = &em_bi[kept_n * em_dim];
+
+    // 保留的行按原来的顺序排，删掉的行都是kept_n
+    for (int64_t r = 0; r < vocab_num; r++)
+        new_row[r] = kept_n;
+    for (int64_t k = 0; k < kept_n; k++)
+        new_row[ranked[k]] = 0;
+    for (int64_t r = 0, k = 0; r < vocab_num; r++)
+        if (new_row[r] == 0)
+            new_row[r] = k++;
+    for (int64_t j = 0; j < em_dim; j++)
+        oov[j] = oov_bi[j] = kept_n < vocab_num ? INFINITY : 0.f;
+    for (int64_t r = 0; r < vocab_num; r++)
+    {
+        const floatx *e = &model->em[r * em_dim], *e_bi = &model->em_bi[r * em_dim];
+        if (new_row[r] < kept_n)
+        {
+            memcpy(&em[new_row[r] * em_dim], e, em_dim * sizeof(floatx));
+            memcpy(&em_bi[new_row[r] * em_dim], e_bi, em_dim * sizeof(floatx));
+            continue;
+        }
+        for (int64_t j = 0; j < em_dim; j++)
+        {
+            oov[j] = oov[j] < e[j] ? oov[j] : e[j];
+            oov_bi[j] = oov_bi[j] < e_bi[j] ? oov_bi[j] : e_bi[j];
+        }
+    }
+    for (int64_t token = 0; token < model->max_token; token++)
+    {
+        int64_t row = fnt_row(model, token);
+        vocab_map[token] = row < 0 ? -1 : (int32_t)new_row[row];
+    }
+
+    memcpy(pruned, model, sizeof(*pruned));
+    pruned->id = __atomic_add_fetch(&fnt_model_ids, 1, __ATOMIC_RELAXED);
+    pruned->base = NULL;
+    pruned->vocab_num = kept_n + 1;
+    pruned->em = em;
+    pruned->em_bi = em_bi;
+    pruned->vocab_map = vocab_map;
+    free(new_row);
+}
+
+void free_pruned(struct fnt_model *pruned)
+{
+    free((void *)pruned->em);
+    free((void *)pruned->em_bi);
+    free((void *)pruned->vocab_map);
+}
+
+// header of the model file of a pruned model, pruned->bytes is set to its size
+void pruned_header(struct fnt_model *pruned, struct model_header_t *header)
+{
+    int64_t em_dim = pruned->em_dim, vocab_num = pruned->vocab_num, category_num = pruned->category_num;
+    model_init_header(header, VARIANT_BI, "bi", em_dim, vocab_num, category_num, pruned->max_token);
+    model_add_table(header, "em", vocab_num, em_dim, MODEL_F32);
+    model_add_table(header, "em_bi", vocab_num, em_dim, MODEL_F32);
+    model_add_table(header, "w", category_num, em_dim, MODEL_F32);
+    model_add_table(header, "w_bi", category_num, em_dim, MODEL_F32);
+    model_add_table(header, "b", 1, category_num, MODEL_F32);
+    model_add_table(header, "vocab_map", pruned->max_token, 1, MODEL_I32);
+    pruned->bytes = header->file_bytes;
+}
+
+// count the wins on calib, write the model keeping the keep fraction of the rows to path
+// with docs: precision, agreement and latency of the original model and of every fraction in curve
+void prune_model(struct fnt_model *model, const char *path, struct docs_t *calib, double keep, const double *curve, int64_t curve_n, struct docs_t *docs)
+{
+    int64_t vocab_num = model->vocab_num, used_n = 0;
+    int64_t *wins = (int64_t *)calloc(vocab_num, sizeof(int64_t));
+    int64_t *ranked = (int64_t *)malloc(vocab_num * sizeof(int64_t));
+    int64_t *preds = (int64_t *)malloc((docs->n > 0 ? docs->n : 1) * sizeof(int64_t));
+    int64_t *pruned_preds = (int64_t *)malloc((docs->n > 0 ? docs->n : 1) * sizeof(int64_t));
+    struct model_header_t header;
+    struct fnt_model pruned;
+    char name[64];
+
+    for (int64_t d = 0; d < calib->n; d++)
+        count_wins(model, &calib->tokens[calib->starts[d]], calib->lens[d], wins);
+    for (int64_t r = 0; r < vocab_num; r++)
+    {
+        ranked[r] = r;
+        used_n += wins[r] > 0;
+    }
+    rank_wins = wins;
+    qsort(ranked, vocab_num, sizeof(int64_t), cmp_rank);
+    fprintf(stderr, "calibration: %ld texts, %ld of %ld rows win a dimension\n", calib->n, used_n, vocab_num);
+
+    if (docs->n > 0)
+    {
+        report_model("original", model, docs, preds, NULL);
+        for (int64_t c = 0; c < curve_n; c++)
+        {
+            int64_t kept_n = (int64_t)ceil(curve[c] * vocab_num);
+            kept_n = kept_n < vocab_num ? kept_n : vocab_num;
+            prune_rows(model, ranked, kept_n, &pruned);
+            pruned_header(&pruned, &header);
+            snprintf(name, sizeof(name), "keep %g (%ld rows)", curve[c], kept_n);
+            report_model(name, &pruned, docs, pruned_preds, preds);
+            free_pruned(&pruned);
+        }
+    }
+
+    int64_t kept_n = (int64_t)ceil(keep * vocab_num);
+    kept_n = kept_n < vocab_num ? kept_n : vocab_num;
+    prune_rows(model, ranked, kept_n, &pruned);
+    pruned_header(&pruned, &header);
+    const void *data[] = {pruned.em, pruned.em_bi, pruned.w, pruned.w_bi, pruned.b, pruned.vocab_map};
+    if (!model_file_write(path, &header, data))
+    {
+        printf("error: can not write model %s\n", path);
+        exit(-1);
+    }
+    fprintf(stderr, "saved %s: %ld of %ld rows and the OOV row, %.1f MB\n", path, kept_n, vocab_num, header.file_bytes / 1048576.);
+    free_pruned(&pruned);
+    free(wins);
+    free(ranked);
+    free(preds);
+    free(pruned_preds);
+}
+
+// server
+// 客户端连上后先收到 int64 category_num
+// 请求: int64 len | int64 tokens[len]，回复: int64 category(-1: 没有词表里的词) | float scores[category_num]
+// 同一个连接上的请求按顺序回复，可以不等回复连续发送
+// 每个连接一个线程读请求放进队列，一个batch线程取出最多max_batch个请求，
+// 最早的请求等了max_wait还凑不满也开始算: 逐个pooling，然后整个batch一起算logits
+// batch线程只把回复放进连接的发送队列，每个连接一个线程写，慢的客户端不会拖住其它连接
+// 发送队列超过SERVER_MAX_REPLIES个回复(客户端不读)就断开这个连接
+// 模型文件被替换时(-reload-ms)自动加载，每个batch用开始时的模型
+// 退出时: 关掉所有连接的读端，等读线程退出，算完队列里的请求，最多再等SERVER_FLUSH_SECONDS把回复发完
+#define SERVER_MAX_TOKENS (1 << 20)
+#define SERVER_MAX_REPLIES (1 << 16)
+#define SERVER_FLUSH_SECONDS (1)
+#define HIST_N (32)
+
+// histogram with log2 buckets: bucket k counts [2^(k-1), 2^k), bucket 0 counts 0
+struct hist_t
+{
+    int64_t n[HIST_N];
+    int64_t count;
+};
+
+void hist_add(struct hist_t *h, int64_t v)
+{
+    int64_t k = v <= 0 ? 0 : 64 - __builtin_clzll((uint64_t)v);
+    h->n[k < HIST_N ? k : HIST_N - 1]++;
+    h->count++;
+}
+
+// upper bound of the q quantile
+int64_t hist_quantile(struct hist_t *h, double q)
+{
+    int64_t sum = 0;
+    for (int64_t k = 0; k < HIST_N; k++)
+    {
+        sum += h->n[k];
+        if (sum > q * h->count)
+            return k == 0 ? 0 : (1ll << k) - 1;
+    }
+    return (1ll << (HIST_N - 1)) - 1;
+}
+
+void hist_print(const char *name, struct hist_t *h)
+{
+    fprintf(stderr, "  %s: p50 <= %ld, p90 <= %ld, p99 <= %ld |", name, hist_quantile(h, 0.5), hist_quantile(h, 0.9), hist_quantile(h, 0.99));
+    for (int64_t k = 0; k < HIST_N; k++)
+        if (h->n[k] > 0)
+            fprintf(stderr, " <%lld:%ld", 1ll << k, h->n[k]);
+    fprintf(stderr, "\n");
+}
+
+struct reply_t
+{
+    struct reply_t *next;
+    int64_t n;
+    char data[];
+};
+
+struct conn_t
+{
+    struct conn_t *next; // server->conns, only the accept thread uses it
+    int fd;
+    pthread_t reader, writer;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct reply_t *head, *tail; // replies not written yet
+    int64_t queued;
+    int64_t refs;     // the reader and the requests in the batch queue, the writer exits when it is 0 and all replies are written
+    int64_t broken;   // write failed or too many replies queued, later replies are dropped
+    int64_t finished; // the writer has exited
+};
+
+struct request_t
+{
+    struct request_t *next;
+    struct conn_t *conn;
+    double arrive;
+    int64_t len;
+    int64_t tokens[];
+};
+
+struct server_t
+{
+    struct fnt_live *live;
+    struct fnt_cache *cache; // NULL: no cache
+    int64_t max_batch;
+    double max_wait; // seconds
+    double stats_every;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct request_t *head, *tail;
+    int64_t depth, stop;
+
+    // only the batch thread writes these
+    struct hist_t depth_hist, batch_hist, latency_hist;
+    int64_t served, batches;
+
+    struct conn_t *conns; // only the accept thread uses it
+};
+
+struct reader_arg_t
+{
+    struct server_t *server;
+    struct conn_t *conn;
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+void on_stop_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+int64_t read_full(int fd, void *buf, int64_t n)
+{
+    for (int64_t done = 0; done < n;)
+    {
+        ssize_t r = read(fd, (char *)buf + done, n - done);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+int64_t write_full(int fd, const void *buf, int64_t n)
+{
+    for (int64_t done = 0; done < n;)
+    {
+        ssize_t r = write(fd, (const char *)buf + done, n - done);
+        if (r <= 0)
+        {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += r;
+    }
+    return 0;
+}
+
+void conn_release(struct conn_t *conn)
+{
+    pthread_mutex_lock(&conn->lock);
+    if (--conn->refs == 0)
+        pthread_cond_signal(&conn->cond);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// queue n bytes for the writer of conn, never blocks
+void conn_send(struct conn_t *conn, const void *buf, int64_t n)
+{
+    struct reply_t *r = NULL;
+    pthread_mutex_lock(&conn->lock);
+    if (!conn->broken && conn->queued >= SERVER_MAX_REPLIES)
+    {
+        // 客户端不读回复，读线程和写线程都会因此退出
+        conn->broken = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+        fprintf(stderr, "warning: a client does not read its replies (%ld queued), close the connection\n", conn->queued);
+    }
+    if (!conn->broken)
+    {
+        r = (struct reply_t *)malloc(sizeof(struct reply_t) + n);
+        r->next = NULL;
+        r->n = n;
+        memcpy(r->data, buf, n);
+        if (conn->tail != NULL)
+            conn->tail->next = r;
+        else
+            conn->head = r;
+        conn->tail = r;
+        conn->queued++;
+        pthread_cond_signal(&conn->cond);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+void *server_writer(void *arg)
+{
+    struct conn_t *conn = (struct conn_t *)arg;
+    pthread_mutex_lock(&conn->lock);
+    for (;;)
+    {
+        while (conn->head == NULL && conn->refs > 0)
+            pthread_cond_wait(&conn->cond, &conn->lock);
+        struct reply_t *r = conn->head;
+        if (r == NULL)
+            break;
+        conn->head = r->next;
+        if (conn->head == NULL)
+            conn->tail = NULL;
+        conn->queued--;
+        int64_t broken = conn->broken;
+        pthread_mutex_unlock(&conn->lock);
+        // 客户端断开了就丢掉回复
+        int64_t failed = !broken && write_full(conn->fd, r->data, r->n) != 0;
+        free(r);
+        pthread_mutex_lock(&conn->lock);
+        if (failed && !conn->broken)
+        {
+            conn->broken = 1;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+    __atomic_store_n(&conn->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void *server_reader(void *arg)
+{
+    struct server_t *server = ((struct reader_arg_t *)arg)->server;
+    struct conn_t *conn = ((struct reader_arg_t *)arg)->conn;
+    int64_t len, ticket, category_num = fnt_category_num(fnt_live_acquire(server->live, &ticket));
+    fnt_live_release(server->live, ticket);
+    free(arg);
+    conn_send(conn, &category_num, sizeof(category_num));
+    while (read_full(conn->fd, &len, sizeof(len)) == 0 && len >= 0 && len <= SERVER_MAX_TOKENS)
+    {
+        struct request_t *req = (struct request_t *)malloc(sizeof(struct request_t) + len * sizeof(int64_t));
+        if (read_full(conn->fd, req->tokens, len * sizeof(int64_t)) != 0)
+        {
+            free(req);
+            break;
+        }
+        req->next = NULL;
+        req->conn = conn;
+        req->len = len;
+        req->arrive = now_seconds();
+        pthread_mutex_lock(&conn->lock);
+        conn->refs++;
+        pthread_mutex_unlock(&conn->lock);
+        pthread_mutex_lock(&server->lock);
+        if (server->tail != NULL)
+            server->tail->next = req;
+        else
+            server->head = req;
+        server->tail = req;
+        server->depth++;
+        pthread_cond_signal(&server->cond);
+        pthread_mutex_unlock(&server->lock);
+    }
+    conn_release(conn);
+    return NULL;
+}
+
+void server_stats(struct server_t *server)
+{
+    fprintf(stderr, "served %ld requests in %ld batches (%.1f per batch)\n", server->served, server->batches,
+            server->batches > 0 ? (double)server->served / server->batches : 0.);
+    hist_print("queue depth", &server->depth_hist);
+    hist_print("batch size", &server->batch_hist);
+    hist_print("latency us", &server->latency_hist);
+    if (server->cache != NULL)
+        print_cache_stats(server->cache);
+}
+
+void *server_batcher(void *arg)
+{
+    struct server_t *server = (struct server_t *)arg;
+    int64_t ticket;
+    struct fnt_model *model = fnt_live_acquire(server->live, &ticket);
+    // 类别数不会变，维数可以变
+    int64_t max_batch = server->max_batch, em_dim = fnt_dim(model), feas_dim = em_dim, category_num = fnt_category_num(model);
+    fnt_live_release(server->live, ticket);
+    struct request_t **reqs = (struct request_t **)malloc(max_batch * sizeof(struct request_t *));
+    float *feas = (float *)malloc(max_batch * 2 * em_dim * sizeof(float));
+    float *scores = (float *)malloc(max_batch * category_num * sizeof(float));
+    int64_t *labels = (int64_t *)malloc(max_batch * sizeof(int64_t));
+    uint8_t *empty = (uint8_t *)malloc(max_batch);
+    // 命中缓存的请求不参与pooling: rows[d] = -1，分数在hit_scores里；其它的请求按顺序放在feas/scores里
+    int64_t *rows = (int64_t *)malloc(max_batch * sizeof(int64_t));
+    int64_t *hit_labels = (int64_t *)malloc(max_batch * sizeof(int64_t));
+    float *hit_scores = server->cache != NULL ? (float *)malloc(max_batch * category_num * sizeof(float)) : NULL;
+    char *reply = (char *)malloc(sizeof(int64_t) + category_num * sizeof(float));
+    double last_stats = now_seconds();
+
+    pthread_mutex_lock(&server->lock);
+    for (;;)
+    {
+        while (server->head == NULL && !server->stop)
+            pthread_cond_wait(&server->cond, &server->lock);
+        if (server->head == NULL)
+            break;
+        // 等到凑满一个batch或者最早的请求到期
+        double deadline = server->head->arrive + server->max_wait;
+        while (server->depth < max_batch && !server->stop)
+        {
+            double now = now_seconds();
+            if (now >= deadline)
+                break;
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            int64_t ns = ts.tv_nsec + (int64_t)((deadline - now) * 1e9);
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&server->cond, &server->lock, &ts);
+        }
+        hist_add(&server->depth_hist, server->depth);
+        int64_t n = 0;
+        while (n < max_batch && server->head != NULL)
+        {
+            reqs[n++] = server->head;
+            server->head = server->head->next;
+        }
+        if (server->head == NULL)
+            server->tail = NULL;
+        server->depth -= n;
+        pthread_mutex_unlock(&server->lock);
+
+        model = fnt_live_acquire(server->live, &ticket);
+        em_dim = fnt_dim(model);
+        if (em_dim > feas_dim)
+        {
+            feas_dim = em_dim;
+            feas = (float *)realloc(feas, max_batch * 2 * feas_dim * sizeof(float));
+        }
+        int64_t pooled_n = 0;
+        for (int64_t d = 0; d < n; d++)
+        {
+            rows[d] = -1;
+            if (server->cache != NULL && fnt_cache_get(server->cache, model, reqs[d]->tokens, reqs[d]->len, &hit_labels[d], &hit_scores[d * category_num]))
+                continue;
+            rows[d] = pooled_n++;
+            empty[rows[d]] = fnt_pool(model, reqs[d]->tokens, reqs[d]->len, &feas[2 * rows[d] * em_dim]) == 0;
+            if (empty[rows[d]])
+                memset(&feas[2 * rows[d] * em_dim], 0, 2 * em_dim * sizeof(float));
+        }
+        if (pooled_n > 0)
+            fnt_head_batch(model, feas, pooled_n, scores, labels);
+        for (int64_t d = 0; server->cache != NULL && d < n; d++)
+            if (rows[d] >= 0 && !empty[rows[d]])
+                fnt_cache_put(server->cache, model, reqs[d]->tokens, reqs[d]->len, labels[rows[d]], &scores[rows[d] * category_num]);
+        fnt_live_release(server->live, ticket);
+        double done = now_seconds();
+        for (int64_t d = 0; d < n; d++)
+        {
+            int64_t label = rows[d] < 0 ? hit_labels[d] : (empty[rows[d]] ? -1 : labels[rows[d]]);
+            const float *score = rows[d] < 0 ? &hit_scores[d * category_num] : &scores[rows[d] * category_num];
+            memcpy(reply, &label, sizeof(label));
+            memcpy(reply + sizeof(label), score, category_num * sizeof(float));
+            conn_send(reqs[d]->conn, reply, sizeof(label) + category_num * sizeof(float));
+            hist_add(&server->latency_hist, (int64_t)((done - reqs[d]->arrive) * 1e6));
+            conn_release(reqs[d]->conn);
+            free(reqs[d]);
+        }
+        hist_add(&server->batch_hist, n);
+        server->served += n;
+        server->batches++;
+        if (server->stats_every > 0 && done - last_stats >= server->stats_every)
+        {
+            server_stats(server);
+            last_stats = done;
+        }
+        pthread_mutex_lock(&server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(reqs);
+    free(feas);
+    free(scores);
+    free(labels);
+    free(empty);
+    free(rows);
+    free(hit_labels);
+    free(hit_scores);
+    free(reply);
+    return NULL;
+}
+
+void conn_free(struct conn_t *conn)
+{
+    for (struct reply_t *r = conn->head, *next; r != NULL; r = next)
+    {
+        next = r->next;
+        free(r);
+    }
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->cond);
+    free(conn);
+}
+
+// join the threads of the closed connections and free them, called by the accept thread
+void server_reap(struct server_t *server)
+{
+    for (struct conn_t **p = &server->conns; *p != NULL;)
+    {
+        struct conn_t *conn = *p;
+        if (!__atomic_load_n(&conn->finished, __ATOMIC_ACQUIRE))
+        {
+            p = &conn->next;
+            continue;
+        }
+        *p = conn->next;
+        pthread_join(conn->reader, NULL);
+        pthread_join(conn->writer, NULL);
+        conn_free(conn);
+    }
+}
+
+// serve the live model on the unix socket at path until SIGINT/SIGTERM
+void serve(struct fnt_live *live, struct fnt_cache *cache, const char *path, int64_t max_batch, double max_wait_us, double stats_every)
+{
+    struct server_t server;
+    struct sockaddr_un addr;
+    pthread_condattr_t attr;
+    pthread_t batcher;
+    sigset_t block, old;
+
+    memset(&server, 0, sizeof(server));
+    server.live = live;
+    server.cache = cache;
+    server.max_batch = max_batch;
+    server.max_wait = max_wait_us * 1e-6;
+    server.stats_every = stats_every;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&server.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("error: socket path %s is too long\n", path);
+        exit(-1);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0)
+    {
+        perror("error");
+        exit(EXIT_FAILURE);
+    }
+
+    // 只有主线程处理信号，accept被打断后退出
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_create(&batcher, NULL, server_batcher, &server);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fprintf(stderr, "serving on %s: max batch %ld, max wait %.0fus\n", path, max_batch, max_wait_us);
+
+    while (!serve_stop)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("error");
+            break;
+        }
+        server_reap(&server);
+        struct conn_t *conn = (struct conn_t *)calloc(1, sizeof(struct conn_t));
+        struct reader_arg_t *arg = (struct reader_arg_t *)malloc(sizeof(struct reader_arg_t));
+        conn->fd = fd;
+        conn->refs = 1;
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+        arg->server = &server;
+        arg->conn = conn;
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        if (pthread_create(&conn->writer, NULL, server_writer, conn) != 0)
+        {
+            free(arg);
+            conn_free(conn);
+        }
+        else if (pthread_create(&conn->reader, NULL, server_reader, arg) != 0)
+        {
+            // 没有读线程，写线程直接退出
+            free(arg);
+            conn_release(conn);
+            pthread_join(conn->writer, NULL);
+            conn_free(conn);
+        }
+        else
+        {
+            conn->next = server.conns;
+            server.conns = conn;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    close(listen_fd);
+    unlink(path);
+
+    // 不再读新的请求，读线程都退出之后队列里不会再有新的请求
+    for (struct conn_t *conn = server.conns; conn != NULL; conn = conn->next)
+        shutdown(conn->fd, SHUT_RD);
+    for (struct conn_t *conn = server.conns; conn != NULL; conn = conn->next)
+        pthread_join(conn->reader, NULL);
+
+    // 算完队列里剩下的请求
+    pthread_mutex_lock(&server.lock);
+    server.stop = 1;
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    pthread_join(batcher, NULL);
+
+    // 回复最多再发SERVER_FLUSH_SECONDS，之后断开还没发完的连接
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SERVER_FLUSH_SECONDS;
+    while (server.conns != NULL)
+    {
+        struct conn_t *conn = server.conns;
+        server.conns = conn->next;
+        if (pthread_timedjoin_np(conn->writer, NULL, &deadline) != 0)
+        {
+            shutdown(conn->fd, SHUT_RDWR);
+            pthread_join(conn->writer, NULL);
+        }
+        conn_free(conn);
+    }
+    server_stats(&server);
+}
+
+// send the lines of fp to the server at path, up to window requests in flight
+void classify_remote(const char *path, FILE *fp, int64_t window, int64_t show_scores, int64_t bench)
+{
+    struct sockaddr_un addr;
+    int64_t category_num = 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || read_full(fd, &category_num, sizeof(category_num)) != 0)
+    {
+        perror("error");
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t tokens_cap = 1024, len, docs_n = 0, labeled_n = 0, correct_n = 0, lat_cap = 1024, eof = 0;
+    int64_t *tokens = (int64_t *)malloc(tokens_cap * sizeof(int64_t));
+    int64_t *labels = (int64_t *)malloc(window * sizeof(int64_t));
+    double *sent = (double *)malloc(window * sizeof(double));
+    double *lats = bench ? (double *)malloc(lat_cap * sizeof(double)) : NULL;
+    char *reply = (char *)malloc(sizeof(int64_t) + category_num * sizeof(float));
+    float *scores = (float *)malloc(category_num * sizeof(float));
+    char *line = NULL;
+    size_t line_cap = 0;
+
+    while (!eof)
+    {
+        int64_t n = 0;
+        while (n < window)
+        {
+            if (getline(&line, &line_cap, fp) <= 0)
+            {
+                eof = 1;
+                break;
+            }
+            labels[n] = parse_line(line, &tokens, &tokens_cap, &len);
+            sent[n] = now_seconds();
+            if (write_full(fd, &len, sizeof(len)) != 0 || write_full(fd, tokens, len * sizeof(int64_t)) != 0)
+            {
+                printf("error: the server closed the connection\n");
+                exit(-1);
+            }
+            n++;
+        }
+        for (int64_t k = 0; k < n; k++)
+        {
+            int64_t pred;
+            if (read_full(fd, reply, sizeof(int64_t) + category_num * sizeof(float)) != 0)
+            {
+                printf("error: the server closed the connection\n");
+                exit(-1);
+            }
+            memcpy(&pred, reply, sizeof(pred));
+            memcpy(scores, reply + sizeof(pred), category_num * sizeof(float));
+            if (bench)
+            {
+                if (docs_n == lat_cap)
+                {
+                    lat_cap *= 2;
+                    lats = (double *)realloc(lats, lat_cap * sizeof(double));
+                }
+                lats[docs_n] = (now_seconds() - sent[k]) * 1e6;
+            }
+            docs_n++;
+            if (labels[k] >= 0)
+            {
+                labeled_n++;
+                correct_n += pred == labels[k];
+            }
+            print_prediction(pred, scores, category_num, show_scores);
+        }
+    }
+    if (labeled_n > 0)
+        fprintf(stderr, "#docs: %ld, precision: %.5f\n", docs_n, (double)correct_n / labeled_n);
+    if (bench)
+        print_latency("round trip", lats, docs_n);
+    close(fd);
+    free(line);
+    free(tokens);
+    free(labels);
+    free(sent);
+    free(lats);
+    free(reply);
+    free(scores);
+}
+
+int main(int argc, char **argv)
+{
+    const char *model_path = NULL, *input_path = NULL, *serve_path = NULL, *connect_path = NULL, *output_path = NULL;
+    const char *quantize_path = NULL, *prune_path = NULL, *calib_path = NULL, *keep_curve = "1,0.5,0.2,0.1,0.05,0.02,0.01";
+    double keep = 0.1;
+    int64_t show_scores = 0, bench = 0, max_batch = 64, window = 64, topk = 0, binary = 0;
+    int64_t cache_n = 0, reload_ms = 1000, pq_m = 0, pq_k = 256, kmeans_iters = 10, kmeans_sample = 16384;
+    double max_wait_us = 200., stats_every = 10.;
+    int i;
+    if ((i = arg_helper("-model", argc, argv)) > 0)
+        model_path = argv[i + 1];
+    if ((i = arg_helper("-input", argc, argv)) > 0)
+        input_path = argv[i + 1];
+    if ((i = arg_helper("-scores", argc, argv)) > 0)
+        show_scores = 1;
+    if ((i = arg_helper("-bench", argc, argv)) > 0)
+        bench = 1;
+    if ((i = arg_helper("-serve", argc, argv)) > 0)
+        serve_path = argv[i + 1];
+    if ((i = arg_helper("-connect", argc, argv)) > 0)
+        connect_path = argv[i + 1];
+    if ((i = arg_helper("-max-batch", argc, argv)) > 0)
+        max_batch = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-max-wait-us", argc, argv)) > 0)
+        max_wait_us = atof(argv[i + 1]);
+    if ((i = arg_helper("-stats-every", argc, argv)) > 0)
+        stats_every = atof(argv[i + 1]);
+    if ((i = arg_helper("-window", argc, argv)) > 0)
+        window = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-reload-ms", argc, argv)) > 0)
+        reload_ms = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-cache", argc, argv)) > 0)
+        cache_n = (int64_t)atoll(argv[i + 1]);
+    if ((i = arg_helper("-topk", argc, argv)) > 0)
+        topk = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-output", argc, argv)) > 0)
+        output_path = argv[i + 1];
+    if ((i = arg_helper("-binary", argc, argv)) > 0)
+        binary = 1;
+    if ((i = arg_helper("-quantize", argc, argv)) > 0)
+        quantize_path = argv[i + 1];
+    if ((i = arg_helper("-subspaces", argc, argv)) > 0)
+        pq_m = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-centroids", argc, argv)) > 0)
+        pq_k = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-kmeans-iters", argc, argv)) > 0)
+        kmeans_iters = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-kmeans-sample", argc, argv)) > 0)
+        kmeans_sample = (int64_t)atoi(argv[i + 1]);
+    if ((i = arg_helper("-prune", argc, argv)) > 0)
+        prune_path = argv[i + 1];
+    if ((i = arg_helper("-calib", argc, argv)) > 0)
+        calib_path = argv[i + 1];
+    if ((i = arg_helper("-keep", argc, argv)) > 0)
+        keep = atof(argv[i + 1]);
+    if ((i = arg_helper("-keep-curve", argc, argv)) > 0)
+        keep_curve = argv[i + 1];
+    if (max_batch < 1 || window < 1)
+    {
+        printf("error: -max-batch and -window must be >= 1");
+        exit(-1);
+    }
+    if (topk < 0 || (topk == 0 && (output_path != NULL || binary)))
+    {
+        printf("error: -output and -binary need -topk k (k >= 1)");
+        exit(-1);
+    }
+
+    FILE *fp = input_path != NULL ? fopen(input_path, "r") : stdin;
+    if (fp == NULL)
+    {
+        perror("error");
+        exit(EXIT_FAILURE);
+    }
+    if (connect_path != NULL)
+    {
+        classify_remote(connect_path, fp, window, show_scores, bench);
+        return 0;
+    }
+    if (model_path == NULL)
+    {
+        printf("error: miss -model");
+        exit(-1);
+    }
+    if (serve_path != NULL)
+    {
+        // 服务时跟着模型文件更新，-reload-ms 0: 不检查
+        struct fnt_live *live = fnt_live_open(model_path, reload_ms);
+        if (live == NULL)
+            exit(-1);
+        int64_t ticket, category_num = fnt_category_num(fnt_live_acquire(live, &ticket));
+        fnt_live_release(live, ticket);
+        struct fnt_cache *cache = cache_n > 0 ? fnt_cache_new(cache_n, category_num) : NULL;
+        serve(live, cache, serve_path, max_batch, max_wait_us, stats_every);
+        fnt_live_close(live);
+        fnt_cache_free(cache);
+        if (fp != stdin)
+            fclose(fp);
+        return 0;
+    }
+    struct fnt_model *model = fnt_load(model_path);
+    if (model == NULL)
+        exit(-1);
+    if (quantize_path != NULL)
+    {
+        // 默认每个子空间4维: dim 400的一行从1600字节变成100字节
+        pq_m = pq_m > 0 ? pq_m : fnt_dim(model) / 4;
+        if (model->em == NULL || pq_m < 1 || fnt_dim(model) % pq_m != 0 || pq_k < 1 || pq_k > 256 || kmeans_sample < 1)
+        {
+            printf("error: -subspaces must divide dim %ld, -centroids must be in [1, 256], the model must not be quantized\n", fnt_dim(model));
+            exit(-1);
+        }
+        struct docs_t docs;
+        memset(&docs, 0, sizeof(docs));
+        if (input_path != NULL)
+            load_docs(&docs, fp);
+        quantize_model(model, quantize_path, pq_m, pq_k, kmeans_iters, kmeans_sample, &docs);
+        free_docs(&docs);
+    }
+    else if (prune_path != NULL)
+    {
+        struct docs_t docs, calib;
+        double curve[64];
+        int64_t curve_n = 0;
+        for (char *p = (char *)keep_curve, *end; curve_n < 64; p = end + (*end == ',' ? 1 : 0))
+        {
+            curve[curve_n] = strtod(p, &end);
+            if (end == p)
+                break;
+            curve_n++;
+        }
+        FILE *calib_fp = calib_path != NULL ? fopen(calib_path, "r") : NULL;
+        if (model->em == NULL || calib_fp == NULL || keep <= 0. || keep > 1.)
+        {
+            printf("error: -prune needs -calib path and -keep in (0, 1], the model must not be quantized\n");
+            exit(-1);
+        }
+        load_docs(&calib, calib_fp);
+        fclose(calib_fp);
+        memset(&docs, 0, sizeof(docs));
+        if (input_path != NULL)
+            load_docs(&docs, fp);
+        prune_model(model, prune_path, &calib, keep, curve, curve_n, &docs);
+        free_docs(&calib);
+        free_docs(&docs);
+    }
+    else if (topk > 0)
+    {
+        FILE *out = output_path != NULL ? fopen(output_path, "wb") : stdout;
+        if (out == NULL)
+        {
+            perror("error");
+            exit(EXIT_FAILURE);
+        }
+        classify_topk(model, fp, out, topk, binary, max_batch, bench);
+        if (out != stdout)
+            fclose(out);
+    }
+    else
+    {
+        struct fnt_cache *cache = cache_n > 0 ? fnt_cache_new(cache_n, fnt_category_num(model)) : NULL;
+        classify_stream(model, cache, fp, show_scores, bench);
+        fnt_cache_free(cache);
+    }
+
+    if (fp != stdin)
+        fclose(fp);
+    fnt_free(model);
+    return 0;
+}
+
+#endif
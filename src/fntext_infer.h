@@ -0,0 +1,72 @@
+// inference library of fntext_bi: load a model written by -save-model and classify token ids
+// the model is read only after fnt_load, every function can be called from any number of threads
+#ifndef FNTEXT_INFER_H
+#define FNTEXT_INFER_H
+
+#include <stdint.h>
+
+struct fnt_model;
+
+// map the model file at path, NULL on error
+struct fnt_model *fnt_load(const char *path);
+void fnt_free(struct fnt_model *model);
+
+int64_t fnt_dim(const struct fnt_model *model);
+int64_t fnt_category_num(const struct fnt_model *model);
+
+// pool tokens[0, len) into fea[0, 2 * dim): unigram max | bigram max
+// returns the number of tokens in the vocabulary, fea is not set if it is 0
+int64_t fnt_pool(const struct fnt_model *model, const int64_t *tokens, int64_t len, float *fea);
+
+// logits of n pooled texts (feas: n * 2 * dim) into scores (n * category_num), the argmax into labels
+void fnt_head_batch(const struct fnt_model *model, const float *feas, int64_t n, float *scores, int64_t *labels);
+
+// the k highest of scores[0, category_num) in descending order into labels, their softmax probabilities into probs
+// ties keep the lower category first, labels[0] is the argmax of fnt_head_batch
+// returns min(k, category_num)
+int64_t fnt_topk(const float *scores, int64_t category_num, int64_t k, int64_t *labels, float *probs);
+
+// classify the text tokens[0, len), token ids as in the training data
+// out_scores: category_num logits, may be NULL
+// returns the predicted category, -1 if no token is in the vocabulary
+// no allocation, the scratch is on the stack (2 * dim + category_num floats)
+int64_t fnt_classify(const struct fnt_model *model, const int64_t *tokens, int64_t len, float *out_scores);
+
+// prediction cache: a bounded cache of the predictions of repeated texts, keyed by the token ids and the model
+// an entry keeps a copy of its tokens and a hit compares them, the hash is seeded at random per cache
+// capacity entries of category_num scores each, split into shards with their own lock, CLOCK eviction in each shard
+// every function can be called from any number of threads
+struct fnt_cache;
+
+struct fnt_cache_stats
+{
+    int64_t hits, misses, insertions, evictions, entries;
+};
+
+struct fnt_cache *fnt_cache_new(int64_t capacity, int64_t category_num);
+void fnt_cache_free(struct fnt_cache *cache);
+// 1 and the label and scores (may be NULL) of the text if it is in the cache
+int64_t fnt_cache_get(struct fnt_cache *cache, const struct fnt_model *model, const int64_t *tokens, int64_t len, int64_t *label, float *scores);
+void fnt_cache_put(struct fnt_cache *cache, const struct fnt_model *model, const int64_t *tokens, int64_t len, int64_t label, const float *scores);
+void fnt_cache_stats(struct fnt_cache *cache, struct fnt_cache_stats *stats);
+// fnt_classify through the cache
+int64_t fnt_classify_cached(const struct fnt_model *model, struct fnt_cache *cache, const int64_t *tokens, int64_t len, float *out_scores);
+
+// hot reload: a live model follows the file at path, a watcher thread checks it every interval_ms
+// and maps a changed file (replace it with rename, like -save-model does) without stopping the readers
+// a new file must have the same category_num, otherwise the current model is kept
+struct fnt_live;
+
+// map the model at path and start watching it, interval_ms = 0: never reload; NULL on error
+struct fnt_live *fnt_live_open(const char *path, int64_t interval_ms);
+// stop watching and free the current model, no reader may be left
+void fnt_live_close(struct fnt_live *live);
+
+// the current model for one request: acquire never blocks, release with the ticket it returned
+// a replaced model is unmapped after every reader that acquired it released it
+struct fnt_model *fnt_live_acquire(struct fnt_live *live, int64_t *ticket);
+void fnt_live_release(struct fnt_live *live, int64_t ticket);
+// the number of models loaded so far, 1 after fnt_live_open
+int64_t fnt_live_version(struct fnt_live *live);
+
+#endif
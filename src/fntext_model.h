@@ -0,0 +1,155 @@
+// model file of fntext_bi, shared by the trainer and the inference library
+// header | tables, 每张表按MODEL_ALIGN对齐，整个文件可以直接mmap使用
+// 推理进程mmap同一个文件时共享page cache里的页，不需要解析和拷贝
+// variant: 模型结构，各个fntext_bi*.c的model_t不同，表按名字查找
+// vocabulary: token >= max_token 的词被忽略(-limit-vocab)，有vocab_map表时 em的行 = vocab_map[token]，-1表示忽略
+// quantized (fntext_infer -quantize): 没有em/em_bi，换成 pq(1, 2: subspaces, centroids) 和每张表的 *_pq_book, *_pq_code
+#ifndef FNTEXT_MODEL_H
+#define FNTEXT_MODEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MODEL_MAGIC "FNTMODL"
+#define MODEL_VERSION (1)
+#define MODEL_BYTE_ORDER (0x0102030405060708ll)
+#define MODEL_ALIGN (4096)
+#define MODEL_MAX_TABLES (16)
+#define MODEL_F32 (0)
+#define MODEL_I32 (1)
+#define MODEL_U8 (2)
+#define VARIANT_BI (1) // fntext_bi.c: max pooling of unigram and bigram embeddings
+
+struct model_table_t
+{
+    char name[16];
+    int64_t offset, rows, cols, dtype;
+};
+
+struct model_header_t
+{
+    char magic[8];
+    int64_t version, byte_order, header_bytes, file_bytes;
+    int64_t variant;
+    char variant_name[16];
+    int64_t em_dim, vocab_num, category_num;
+    int64_t max_token;
+    int64_t tables_n;
+    struct model_table_t tables[MODEL_MAX_TABLES];
+};
+
+static inline int64_t model_dtype_bytes(int64_t dtype)
+{
+    return dtype == MODEL_U8 ? 1 : 4;
+}
+
+static inline void model_init_header(struct model_header_t *header, int64_t variant, const char *variant_name, int64_t em_dim, int64_t vocab_num,
+                                     int64_t category_num, int64_t max_token)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header->version = MODEL_VERSION;
+    header->byte_order = MODEL_BYTE_ORDER;
+    header->header_bytes = sizeof(*header);
+    header->file_bytes = (sizeof(*header) + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+    header->variant = variant;
+    strncpy(header->variant_name, variant_name, sizeof(header->variant_name) - 1);
+    header->em_dim = em_dim;
+    header->vocab_num = vocab_num;
+    header->category_num = category_num;
+    header->max_token = max_token;
+}
+
+static inline void model_add_table(struct model_header_t *header, const char *name, int64_t rows, int64_t cols, int64_t dtype)
+{
+    struct model_table_t *table = &header->tables[header->tables_n++];
+    strncpy(table->name, name, sizeof(table->name) - 1);
+    table->offset = header->file_bytes;
+    table->rows = rows;
+    table->cols = cols;
+    table->dtype = dtype;
+    header->file_bytes = (header->file_bytes + rows * cols * model_dtype_bytes(dtype) + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+}
+
+// write the header and data[k] of header->tables[k] to path.tmp, then rename it to path, 0 on error
+static inline int64_t model_file_write(const char *path, struct model_header_t *header, const void *const *data)
+{
+    static const char zeros[MODEL_ALIGN];
+    char tmp_path[4200];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    int64_t ok = fp != NULL && fwrite(header, sizeof(*header), 1, fp) == 1;
+    int64_t pos = sizeof(*header);
+    for (int64_t k = 0; ok && k < header->tables_n; k++)
+    {
+        struct model_table_t *table = &header->tables[k];
+        int64_t bytes = table->rows * table->cols * model_dtype_bytes(table->dtype);
+        ok = fwrite(zeros, 1, table->offset - pos, fp) == (size_t)(table->offset - pos) && fwrite(data[k], 1, bytes, fp) == (size_t)bytes;
+        pos = table->offset + bytes;
+    }
+    ok = ok && fwrite(zeros, 1, header->file_bytes - pos, fp) == (size_t)(header->file_bytes - pos) && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fp != NULL)
+        fclose(fp);
+    return ok && rename(tmp_path, path) == 0;
+}
+
+// map the model file at path with one private mmap and check its header, NULL on error
+// pages are shared with the page cache until they are written
+static char *model_file_map(const char *path, int64_t *bytes)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("error: can not open model %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    *bytes = st.st_size;
+    char *base = *bytes >= (int64_t)sizeof(struct model_header_t) ? (char *)mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : (char *)MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        printf("error: can not map model %s\n", path);
+        return NULL;
+    }
+    struct model_header_t *header = (struct model_header_t *)base;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0 || header->version != MODEL_VERSION || header->byte_order != MODEL_BYTE_ORDER ||
+        header->header_bytes != sizeof(*header) || header->file_bytes != *bytes || header->tables_n < 0 || header->tables_n > MODEL_MAX_TABLES)
+    {
+        printf("error: %s is not a model file (version %d)\n", path, MODEL_VERSION);
+        munmap(base, *bytes);
+        return NULL;
+    }
+    return base;
+}
+
+// the table called name in the mapped model, NULL if there is none
+// *bad is set if the table does not have the expected shape
+static void *model_file_table(char *base, int64_t bytes, const char *name, int64_t rows, int64_t cols, int64_t dtype, int64_t *bad)
+{
+    struct model_header_t *header = (struct model_header_t *)base;
+    for (int64_t k = 0; k < header->tables_n; k++)
+    {
+        struct model_table_t *table = &header->tables[k];
+        if (strncmp(table->name, name, sizeof(table->name)) != 0)
+            continue;
+        if (table->rows != rows || table->cols != cols || table->dtype != dtype || table->offset % MODEL_ALIGN != 0 ||
+            table->offset < 0 || table->offset + rows * cols * model_dtype_bytes(dtype) > bytes)
+        {
+            printf("error: table %s of the model has a wrong shape\n", name);
+            *bad = 1;
+            return NULL;
+        }
+        return base + table->offset;
+    }
+    return NULL;
+}
+
+#endif